@@ -0,0 +1,358 @@
+#include "aio.h"
+#include <errno.h>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* There is no liburing here: the two system calls are made directly */
+static int io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ringfd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ringfd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+AsyncIO::AsyncIO(int f, int d, bool allowUring)
+{
+	fd = f;
+	depth = d;
+	inflight = 0;
+	ringfd = -1;
+	toSubmit = 0;
+	sqRing = cqRing = 0;
+	sqes = 0;
+	reaping = false;
+	stopping = false;
+
+	if (!allowUring || !setup_uring(depth))
+	{
+		for (int i = 0; i < FALLBACK_THREADS; i++)
+		{
+			threads.emplace_back(&AsyncIO::worker, this);
+		}
+	}
+
+	slots.resize(depth);
+	for (int i = depth - 1; i >= 0; i--)
+	{
+		freeSlots.push_back(i);
+	}
+}
+
+AsyncIO::~AsyncIO()
+{
+	wait();
+
+	if (ringfd >= 0)
+	{
+		munmap(sqes, sqesSize);
+		if (cqRing != sqRing)
+		{
+			munmap(cqRing, cqRingSize);
+		}
+		munmap(sqRing, sqRingSize);
+		close(ringfd);
+		return;
+	}
+
+	{
+		lock_guard<mutex> guard(queueLock);
+		stopping = true;
+	}
+	queued.notify_all();
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+}
+
+bool AsyncIO::setup_uring(int entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ringfd = io_uring_setup(entries, &params);
+	if (ringfd < 0)
+	{
+		/* Old kernel, or io_uring disabled (seccomp, io_uring_disabled): the fallback is used */
+		ringfd = -1;
+		return false;
+	}
+
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+	}
+
+	sqRing = mmap(0, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+	if (sqRing == MAP_FAILED)
+	{
+		close(ringfd);
+		ringfd = -1;
+		return false;
+	}
+	cqRing = sqRing;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		cqRing = mmap(0, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+		if (cqRing == MAP_FAILED)
+		{
+			munmap(sqRing, sqRingSize);
+			close(ringfd);
+			ringfd = -1;
+			return false;
+		}
+	}
+
+	sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqesArea = mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+	if (sqesArea == MAP_FAILED)
+	{
+		if (cqRing != sqRing)
+		{
+			munmap(cqRing, cqRingSize);
+		}
+		munmap(sqRing, sqRingSize);
+		close(ringfd);
+		ringfd = -1;
+		return false;
+	}
+	sqes = (struct io_uring_sqe *)sqesArea;
+
+	char *sq = (char *)sqRing;
+	char *cq = (char *)cqRing;
+	sqTail = (unsigned int *)(sq + params.sq_off.tail);
+	sqMask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	sqArray = (unsigned int *)(sq + params.sq_off.array);
+	cqHead = (unsigned int *)(cq + params.cq_off.head);
+	cqTail = (unsigned int *)(cq + params.cq_off.tail);
+	cqMask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	/* Never more in flight than the submission ring holds, so the completion ring can't overflow */
+	depth = params.sq_entries;
+	return true;
+}
+
+bool AsyncIO::is_uring()
+{
+	return ringfd >= 0;
+}
+
+void AsyncIO::submit_read(const vector<struct iovec> &iov, off_t offset, completion_fn done)
+{
+	submit(false, iov, offset, done);
+}
+
+void AsyncIO::submit_write(const vector<struct iovec> &iov, off_t offset, completion_fn done)
+{
+	submit(true, iov, offset, done);
+}
+
+void AsyncIO::submit(bool write, const vector<struct iovec> &iov, off_t offset, completion_fn done)
+{
+	unique_lock<mutex> guard(queueLock);
+
+	/* A full queue makes room by completing the oldest requests first */
+	wait_until(guard, [this] { return inflight < depth; });
+
+	int slot = freeSlots.back();
+	freeSlots.pop_back();
+	inflight++;
+
+	aio_request &request = slots[slot];
+	request.write = write;
+	request.iov.assign(iov.begin(), iov.end());
+	request.offset = offset;
+	request.done = done;
+
+	if (ringfd >= 0)
+	{
+		uring_push(slot);
+		return;
+	}
+
+	/* Threads get their own copy, the slots are only used with the lock held */
+	pending.push_back(make_pair(slot, request));
+	guard.unlock();
+	queued.notify_one();
+}
+
+void AsyncIO::wait()
+{
+	unique_lock<mutex> guard(queueLock);
+	wait_until(guard, [this] { return inflight == 0; });
+}
+
+void AsyncIO::wait(const function<bool()> &finished)
+{
+	unique_lock<mutex> guard(queueLock);
+	wait_until(guard, finished);
+}
+
+void AsyncIO::wait_until(unique_lock<mutex> &guard, const function<bool()> &finished)
+{
+	/* Completions are collected for every thread, so whoever is waiting runs the callbacks of the others too */
+	while (!finished())
+	{
+		if (ringfd >= 0)
+		{
+			if (!reaping)
+			{
+				uring_reap(guard);
+			}
+			else if (toSubmit > 0)
+			{
+				/* Another thread waits in the kernel: ours only have to get there, it collects them */
+				uring_submit(guard);
+			}
+			else
+			{
+				reaped.wait(guard);
+			}
+			continue;
+		}
+
+		if (results.empty())
+		{
+			completed.wait(guard);
+			continue;
+		}
+
+		deque<pair<int, ssize_t>> finishedRequests;
+		finishedRequests.swap(results);
+		for (size_t i = 0; i < finishedRequests.size(); i++)
+		{
+			complete(finishedRequests[i].first, finishedRequests[i].second);
+		}
+		/* Some of them may belong to the other waiting threads */
+		completed.notify_all();
+	}
+}
+
+void AsyncIO::complete(int slot, ssize_t result)
+{
+	/* The slot is free before the callback runs */
+	completion_fn done;
+	done.swap(slots[slot].done);
+	freeSlots.push_back(slot);
+	inflight--;
+	done(result);
+}
+
+void AsyncIO::uring_push(int slot)
+{
+	aio_request &request = slots[slot];
+
+	/* Only the kernel moves the head, the tail is ours */
+	unsigned int tail = *sqTail;
+	unsigned int index = tail & *sqMask;
+	struct io_uring_sqe *sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)request.iov.data();
+	sqe->len = request.iov.size();
+	sqe->off = request.offset;
+	sqe->user_data = slot;
+	sqArray[index] = index;
+
+	/* The entry must be visible before the kernel sees the new tail */
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+	toSubmit++;
+}
+
+void AsyncIO::uring_submit(unique_lock<mutex> &guard)
+{
+	/* The kernel takes the entries from the ring itself, so the lock isn't needed during the call */
+	unsigned int count = toSubmit;
+	toSubmit = 0;
+	guard.unlock();
+	int result = io_uring_enter(ringfd, count, 0, 0);
+	int error = errno;
+	guard.lock();
+
+	if (result < 0 && error != EINTR && error != EAGAIN && error != EBUSY)
+	{
+		cout << "ERROR: io_uring_enter failed: " << strerror(error) << "\n";
+		abort();
+	}
+	/* Entries it didn't take yet go with the next call */
+	toSubmit += count - (result > 0 ? min((unsigned int)result, count) : 0);
+}
+
+void AsyncIO::uring_reap(unique_lock<mutex> &guard)
+{
+	/* Submits whatever was queued since the last call and waits for at least one completion */
+	reaping = true;
+	unsigned int count = toSubmit;
+	toSubmit = 0;
+	guard.unlock();
+	int result = io_uring_enter(ringfd, count, 1, IORING_ENTER_GETEVENTS);
+	int error = errno;
+	guard.lock();
+	reaping = false;
+
+	if (result < 0 && error != EINTR && error != EAGAIN && error != EBUSY)
+	{
+		cout << "ERROR: io_uring_enter failed: " << strerror(error) << "\n";
+		abort();
+	}
+	toSubmit += count - (result > 0 ? min((unsigned int)result, count) : 0);
+
+	unsigned int head = *cqHead;
+	unsigned int tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+	while (head != tail)
+	{
+		struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+		int slot = (int)cqe->user_data;
+		ssize_t result = cqe->res;
+		head++;
+		__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+		complete(slot, result);
+	}
+	reaped.notify_all();
+}
+
+void AsyncIO::worker()
+{
+	while (true)
+	{
+		unique_lock<mutex> guard(queueLock);
+		queued.wait(guard, [this] { return stopping || !pending.empty(); });
+		if (pending.empty())
+		{
+			return;
+		}
+		int slot = pending.front().first;
+		aio_request request = pending.front().second;
+		pending.pop_front();
+		guard.unlock();
+
+		ssize_t result;
+		if (request.write)
+		{
+			result = pwritev(fd, request.iov.data(), request.iov.size(), request.offset);
+		}
+		else
+		{
+			result = preadv(fd, request.iov.data(), request.iov.size(), request.offset);
+		}
+		if (result < 0)
+		{
+			result = -errno;
+		}
+
+		guard.lock();
+		results.push_back(make_pair(slot, result));
+		guard.unlock();
+		completed.notify_one();
+	}
+}
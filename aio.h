@@ -0,0 +1,110 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/*
+* Asynchronous vectored reads and writes on a file descriptor. Requests are queued with submit_read
+* and submit_write and run in parallel; their callbacks run in whichever caller is collecting
+* completions, from a wait or from a submit that had to make room for more requests.
+* Uses io_uring when the kernel allows it, and a pool of threads doing preadv/pwritev otherwise.
+* Any thread may submit and wait at the same time. Callbacks run with the engine's lock held, so
+* they must be short and must not call back into it.
+*/
+class AsyncIO
+{
+public:
+	/* Called with the number of bytes transferred, or -errno */
+	typedef function<void(ssize_t result)> completion_fn;
+
+	/* Requests in flight at once */
+	static const int DEFAULT_QUEUE_DEPTH = 64;
+	/* Threads of the fallback, when io_uring is not available */
+	static const int FALLBACK_THREADS = 4;
+
+	AsyncIO(int fd, int depth = DEFAULT_QUEUE_DEPTH, bool allowUring = true);
+	~AsyncIO();
+
+	/* The iovecs are copied, the buffers they point to must stay valid until the callback runs */
+	void submit_read(const vector<struct iovec> &iov, off_t offset, completion_fn done);
+	void submit_write(const vector<struct iovec> &iov, off_t offset, completion_fn done);
+
+	/* Waits until every submitted request completed, running their callbacks */
+	void wait();
+	/* Waits until 'finished' holds, which callbacks make true; it's checked with the engine's lock held */
+	void wait(const function<bool()> &finished);
+
+	bool is_uring();
+
+private:
+	class aio_request
+	{
+	public:
+		bool write;
+		vector<struct iovec> iov;
+		off_t offset;
+		completion_fn done;
+	};
+
+	void submit(bool write, const vector<struct iovec> &iov, off_t offset, completion_fn done);
+	void wait_until(unique_lock<mutex> &guard, const function<bool()> &finished);
+	void complete(int slot, ssize_t result);
+	bool setup_uring(int entries);
+	void uring_push(int slot);
+	void uring_submit(unique_lock<mutex> &guard);
+	void uring_reap(unique_lock<mutex> &guard);
+	void worker();
+
+private:
+	int fd;
+	int depth;
+	/* Guards everything below, including the fallback's queues */
+	mutex queueLock;
+	/* One slot per request that can be in flight, reused so that submitting allocates nothing */
+	vector<aio_request> slots;
+	vector<int> freeSlots;
+	int inflight;
+
+	/* io_uring: ring file descriptor (-1 when not used) and the shared rings */
+	int ringfd;
+	unsigned int toSubmit;
+	void *sqRing;
+	size_t sqRingSize;
+	void *cqRing;
+	size_t cqRingSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+	unsigned int *sqTail;
+	unsigned int *sqMask;
+	unsigned int *sqArray;
+	unsigned int *cqHead;
+	unsigned int *cqTail;
+	unsigned int *cqMask;
+	struct io_uring_cqe *cqes;
+	/* Set while a thread waits in the kernel for completions, with the lock released; the others wait for 'reaped' */
+	bool reaping;
+	condition_variable reaped;
+
+	/* Fallback: requests waiting for a thread, and results waiting for wait() */
+	vector<thread> threads;
+	condition_variable queued;
+	condition_variable completed;
+	deque<pair<int, aio_request>> pending;
+	deque<pair<int, ssize_t>> results;
+	bool stopping;
+};
+
+#endif
@@ -0,0 +1,341 @@
+#include "bitmap.h"
+#include <algorithm>
+#include <string.h>
+
+Bitmap::Bitmap(int n)
+{
+	reset(n);
+}
+
+void Bitmap::reset(int n)
+{
+	nbits = n > 0 ? n : 0;
+	nwords = (int)(((long long)nbits + 63) / 64);
+	hint = 0;
+
+	words.assign(nwords, 0);
+	fullWords.assign((nwords + 63) / 64, 0);
+
+	/* Bits past the end are marked as used so they are never found as free */
+	if (nbits % 64 != 0)
+	{
+		words[nwords - 1] = ~0ULL << (nbits % 64);
+	}
+	if (nwords % 64 != 0)
+	{
+		fullWords[fullWords.size() - 1] = ~0ULL << (nwords % 64);
+	}
+}
+
+int Bitmap::size() const
+{
+	return nbits;
+}
+
+bool Bitmap::get(int index) const
+{
+	return (words[index >> 6] >> (index & 63)) & 1;
+}
+
+void Bitmap::set(int index)
+{
+	int w = index >> 6;
+	words[w] |= 1ULL << (index & 63);
+
+	if (words[w] == ~0ULL)
+	{
+		fullWords[w >> 6] |= 1ULL << (w & 63);
+	}
+}
+
+void Bitmap::clear(int index)
+{
+	int w = index >> 6;
+	words[w] &= ~(1ULL << (index & 63));
+	fullWords[w >> 6] &= ~(1ULL << (w & 63));
+}
+
+int Bitmap::find_free()
+{
+	/* Looks from the hint to the end first, then wraps around to the beginning */
+	int pos = find_zero(hint, nbits);
+	if (pos == -1)
+	{
+		pos = find_zero(0, hint);
+	}
+
+	if (pos != -1)
+	{
+		hint = pos + 1 < nbits ? pos + 1 : 0;
+	}
+	return pos;
+}
+
+int Bitmap::find_run(int count, int &length)
+{
+	/*
+	* Looks for 'count' consecutive free bits with the same next-fit order as find_free.
+	* When there is no such run, the longest one available is returned instead and
+	* 'length' tells how many bits it has. Returns -1 when nothing is free.
+	*/
+	int afterLength;
+	int after = longest_run_in(hint, nbits, count, afterLength);
+
+	int start = after;
+	length = afterLength;
+	if (afterLength < count)
+	{
+		int beforeLength;
+		int before = longest_run_in(0, hint, count, beforeLength);
+		if (beforeLength > afterLength)
+		{
+			start = before;
+			length = beforeLength;
+		}
+	}
+
+	if (start != -1)
+	{
+		hint = start + length < nbits ? start + length : 0;
+	}
+	return start;
+}
+
+int Bitmap::longest_run_in(int from, int to, int count, int &length) const
+{
+	int best = -1;
+	length = 0;
+
+	int pos = from;
+	while (pos < to)
+	{
+		int start = find_zero(pos, to);
+		if (start == -1)
+		{
+			break;
+		}
+
+		/* Runs are never measured past 'count' bits, which is all the caller wants */
+		int limit = count < to - start ? start + count : to;
+		int end = find_one(start, limit);
+		if (end == -1)
+		{
+			end = limit;
+		}
+
+		if (end - start > length)
+		{
+			best = start;
+			length = end - start;
+			if (length == count)
+			{
+				break;
+			}
+		}
+		pos = end;
+	}
+	return best;
+}
+
+int Bitmap::find_zero(int from, int to) const
+{
+	if (from < 0)
+	{
+		from = 0;
+	}
+	if (to > nbits)
+	{
+		to = nbits;
+	}
+	if (from >= to)
+	{
+		return -1;
+	}
+
+	int w = from >> 6;
+	/* Ignores the bits of the first word that are before 'from' */
+	uint64_t freeBits = ~words[w] & (~0ULL << (from & 63));
+
+	while (true)
+	{
+		if (freeBits)
+		{
+			int pos = (w << 6) + __builtin_ctzll(freeBits);
+			return pos < to ? pos : -1;
+		}
+
+		w = next_nonfull_word(w + 1);
+		if (w == -1 || (w << 6) >= to)
+		{
+			return -1;
+		}
+		freeBits = ~words[w];
+	}
+}
+
+int Bitmap::find_one(int from, int to) const
+{
+	if (from < 0)
+	{
+		from = 0;
+	}
+	if (to > nbits)
+	{
+		to = nbits;
+	}
+	if (from >= to)
+	{
+		return -1;
+	}
+
+	int w = from >> 6;
+	uint64_t usedBits = words[w] & (~0ULL << (from & 63));
+
+	while (!usedBits)
+	{
+		if (++w >= nwords || (w << 6) >= to)
+		{
+			return -1;
+		}
+		usedBits = words[w];
+	}
+
+	/* The padding bits of the last word are set, and may be past what an int holds */
+	long long pos = ((long long)w << 6) + __builtin_ctzll(usedBits);
+	return pos < to ? (int)pos : -1;
+}
+
+int Bitmap::next_nonfull_word(int word) const
+{
+	if (word >= nwords)
+	{
+		return -1;
+	}
+
+	int s = word >> 6;
+	uint64_t nonFull = ~fullWords[s] & (~0ULL << (word & 63));
+
+	while (true)
+	{
+		if (nonFull)
+		{
+			return (s << 6) + __builtin_ctzll(nonFull);
+		}
+
+		if (++s >= (int)fullWords.size())
+		{
+			return -1;
+		}
+		nonFull = ~fullWords[s];
+	}
+}
+
+int Bitmap::count_set() const
+{
+	int count = 0;
+	for (int w = 0; w < nwords; w++)
+	{
+		count += __builtin_popcountll(words[w]);
+	}
+
+	/* Discounts the padding bits of the last word */
+	if (nbits % 64 != 0)
+	{
+		count -= 64 - nbits % 64;
+	}
+	return count;
+}
+
+int Bitmap::byte_size() const
+{
+	return nwords * sizeof(uint64_t);
+}
+
+void Bitmap::save(char *data) const
+{
+	memcpy(data, words.data(), byte_size());
+}
+
+void Bitmap::save_range(char *data, int firstByte, int length) const
+{
+	int copied = max(0, min(length, byte_size() - firstByte));
+	memcpy(data, (const char *)words.data() + firstByte, copied);
+	memset(data + copied, 0, length - copied);
+}
+
+void Bitmap::load(const char *data)
+{
+	memcpy(words.data(), data, byte_size());
+
+	/* Whatever was stored, the bits past the end must stay used */
+	if (nbits % 64 != 0)
+	{
+		words[nwords - 1] |= ~0ULL << (nbits % 64);
+	}
+	rebuild_summary();
+}
+
+void Bitmap::merge(const Bitmap &other, vector<int> *common)
+{
+	for (int w = 0; w < nwords; w++)
+	{
+		if (common)
+		{
+			uint64_t both = words[w] & other.words[w];
+			/* The padding is set in every bitmap, it's not a bit in common */
+			if (w == nwords - 1 && nbits % 64 != 0)
+			{
+				both &= ~(~0ULL << (nbits % 64));
+			}
+			while (both)
+			{
+				common->push_back(w * 64 + __builtin_ctzll(both));
+				both &= both - 1;
+			}
+		}
+		words[w] |= other.words[w];
+	}
+	rebuild_summary();
+}
+
+int Bitmap::find_difference(const Bitmap &other, int from) const
+{
+	if (from < 0)
+	{
+		from = 0;
+	}
+	if (from >= nbits)
+	{
+		return -1;
+	}
+
+	/* The padding is set in both, so it never differs */
+	int w = from >> 6;
+	uint64_t diff = (words[w] ^ other.words[w]) & (~0ULL << (from & 63));
+	while (!diff)
+	{
+		if (++w >= nwords)
+		{
+			return -1;
+		}
+		diff = words[w] ^ other.words[w];
+	}
+	return (w << 6) + __builtin_ctzll(diff);
+}
+
+void Bitmap::rebuild_summary()
+{
+	fill(fullWords.begin(), fullWords.end(), 0);
+	if (nwords % 64 != 0)
+	{
+		fullWords[fullWords.size() - 1] = ~0ULL << (nwords % 64);
+	}
+
+	for (int w = 0; w < nwords; w++)
+	{
+		if (words[w] == ~0ULL)
+		{
+			fullWords[w >> 6] |= 1ULL << (w & 63);
+		}
+	}
+}
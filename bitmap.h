@@ -0,0 +1,59 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+/*
+* Bitmap stored in 64-bit words, where a set bit means "in use".
+* A second level keeps one bit per word that is completely used, so full regions
+* are skipped 4096 bits at a time when looking for a free bit.
+*/
+class Bitmap
+{
+public:
+	Bitmap(int nbits = 0);
+
+	void reset(int nbits);
+	int size() const;
+
+	bool get(int index) const;
+	void set(int index);
+	void clear(int index);
+
+	int find_free();
+	int find_run(int count, int &length);
+	int find_zero(int from, int to) const;
+	int find_one(int from, int to) const;
+	int count_set() const;
+
+	/* Raw words, for keeping the bitmap on disk: save/load move byte_size() bytes */
+	int byte_size() const;
+	void save(char *data) const;
+	void load(const char *data);
+	/* Only 'length' bytes starting at 'firstByte', zero-filled past the end of the bitmap */
+	void save_range(char *data, int firstByte, int length) const;
+
+	/* Word-wise OR with a bitmap of the same size; bits set in both are appended to 'common', if given */
+	void merge(const Bitmap &other, vector<int> *common = nullptr);
+	/* First bit from 'from' on that isn't the same in a bitmap of the same size, -1 if there is none */
+	int find_difference(const Bitmap &other, int from) const;
+
+private:
+	int next_nonfull_word(int word) const;
+	int longest_run_in(int from, int to, int count, int &length) const;
+	void rebuild_summary();
+
+private:
+	int nbits;
+	int nwords;
+	vector<uint64_t> words;
+	/* Bit i is set when words[i] has no zero bit left */
+	vector<uint64_t> fullWords;
+	/* Next-fit: searches start right after the last bit handed out */
+	int hint;
+};
+
+#endif
@@ -0,0 +1,225 @@
+#include "cache.h"
+#include <algorithm>
+#include <string.h>
+
+BlockCache::BlockCache(int capacity, int bsize, writeback_fn wb)
+{
+	writeback = wb;
+	allocate_slots(capacity, bsize);
+
+	ndirty = 0;
+	nhits = 0;
+	nmisses = 0;
+	nevictions = 0;
+}
+
+void BlockCache::allocate_slots(int capacity, int bsize)
+{
+	ncapacity = capacity > 0 ? capacity : 0;
+	blocksize = bsize;
+
+	storage.assign((size_t)ncapacity * blocksize, 0);
+	slotBlock.assign(ncapacity, -1);
+	slotDirty.assign(ncapacity, false);
+	slotPosition.assign(ncapacity, list<int>::iterator());
+	lru.clear();
+	index.clear();
+
+	/* Every slot starts free */
+	freeSlots.clear();
+	for (int i = ncapacity - 1; i >= 0; i--)
+	{
+		freeSlots.push_back(i);
+	}
+}
+
+bool BlockCache::lookup(int blocknum, char *data)
+{
+	if (ncapacity == 0)
+	{
+		return false;
+	}
+
+	unordered_map<int, int>::iterator it = index.find(blocknum);
+	if (it == index.end())
+	{
+		nmisses++;
+		return false;
+	}
+
+	int slot = it->second;
+	memcpy(data, &storage[(size_t)slot * blocksize], blocksize);
+
+	/* Moves the slot to the front of the LRU list */
+	lru.splice(lru.begin(), lru, slotPosition[slot]);
+	nhits++;
+	return true;
+}
+
+bool BlockCache::contains(int blocknum)
+{
+	return index.find(blocknum) != index.end();
+}
+
+void BlockCache::insert(int blocknum, const char *data, bool dirty)
+{
+	if (ncapacity == 0)
+	{
+		return;
+	}
+
+	int slot;
+	unordered_map<int, int>::iterator it = index.find(blocknum);
+	if (it != index.end())
+	{
+		/* Already cached: only refreshes its content and position */
+		slot = it->second;
+		lru.splice(lru.begin(), lru, slotPosition[slot]);
+	}
+	else
+	{
+		slot = take_slot();
+		slotBlock[slot] = blocknum;
+		index[blocknum] = slot;
+		lru.push_front(slot);
+		slotPosition[slot] = lru.begin();
+	}
+
+	memcpy(&storage[(size_t)slot * blocksize], data, blocksize);
+
+	/* A clean insert never cleans a block that still has to be written back */
+	if (dirty && !slotDirty[slot])
+	{
+		slotDirty[slot] = true;
+		ndirty++;
+	}
+}
+
+void BlockCache::invalidate(int blocknum)
+{
+	unordered_map<int, int>::iterator it = index.find(blocknum);
+	if (it == index.end())
+	{
+		return;
+	}
+
+	int slot = it->second;
+	if (slotDirty[slot])
+	{
+		write_slots(vector<int>(1, slot));
+	}
+	lru.erase(slotPosition[slot]);
+	slotBlock[slot] = -1;
+	index.erase(it);
+	freeSlots.push_back(slot);
+}
+
+void BlockCache::flush()
+{
+	/*
+	* Writes dirty blocks in block-number order, so the image file is written sequentially,
+	* and hands adjacent blocks over together so they can go out in a single request.
+	*/
+	vector<pair<int, int> > dirtySlots;
+	for (int slot = 0; slot < ncapacity; slot++)
+	{
+		if (slotDirty[slot])
+		{
+			dirtySlots.push_back(make_pair(slotBlock[slot], slot));
+		}
+	}
+	sort(dirtySlots.begin(), dirtySlots.end());
+
+	vector<int> run;
+	for (size_t i = 0; i < dirtySlots.size(); i++)
+	{
+		if (!run.empty() && dirtySlots[i].first != dirtySlots[i - 1].first + 1)
+		{
+			write_slots(run);
+			run.clear();
+		}
+		run.push_back(dirtySlots[i].second);
+	}
+
+	if (!run.empty())
+	{
+		write_slots(run);
+	}
+}
+
+void BlockCache::write_slots(const vector<int> &slots)
+{
+	vector<const char *> blocks;
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		blocks.push_back(&storage[(size_t)slots[i] * blocksize]);
+	}
+	writeback(slotBlock[slots[0]], blocks);
+
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		slotDirty[slots[i]] = false;
+		ndirty--;
+	}
+}
+
+void BlockCache::clear()
+{
+	while (!lru.empty())
+	{
+		invalidate(slotBlock[lru.back()]);
+	}
+}
+
+void BlockCache::resize(int capacity, int bsize)
+{
+	flush();
+	allocate_slots(capacity, bsize);
+}
+
+int BlockCache::take_slot()
+{
+	if (!freeSlots.empty())
+	{
+		int slot = freeSlots.back();
+		freeSlots.pop_back();
+		return slot;
+	}
+
+	/* No free slot left: the least recently used block is evicted */
+	int slot = lru.back();
+	if (slotDirty[slot])
+	{
+		write_slots(vector<int>(1, slot));
+	}
+	lru.pop_back();
+	index.erase(slotBlock[slot]);
+	slotBlock[slot] = -1;
+	nevictions++;
+	return slot;
+}
+
+int BlockCache::capacity()
+{
+	return ncapacity;
+}
+
+int BlockCache::dirty_blocks()
+{
+	return ndirty;
+}
+
+int BlockCache::hits()
+{
+	return nhits;
+}
+
+int BlockCache::misses()
+{
+	return nmisses;
+}
+
+int BlockCache::evictions()
+{
+	return nevictions;
+}
@@ -0,0 +1,64 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+/*
+* Fixed-capacity block cache with LRU replacement.
+* It only stores copies of blocks; the Disk that owns it is the one doing the actual I/O,
+* so dirty blocks are handed back through the writeback function when they leave the cache.
+*/
+class BlockCache
+{
+public:
+	/* Receives a run of consecutive dirty blocks starting at 'blocknum' */
+	typedef function<void(int blocknum, const vector<const char *> &blocks)> writeback_fn;
+
+	BlockCache(int capacity, int blocksize, writeback_fn writeback);
+
+	bool lookup(int blocknum, char *data);
+	bool contains(int blocknum);
+	void insert(int blocknum, const char *data, bool dirty = false);
+	void invalidate(int blocknum);
+	void flush();
+	void clear();
+	/* Writes back what is dirty and starts over empty, with slots of another size */
+	void resize(int capacity, int blocksize);
+
+	int capacity();
+	int dirty_blocks();
+	int hits();
+	int misses();
+	int evictions();
+
+private:
+	void allocate_slots(int capacity, int blocksize);
+	int take_slot();
+	void write_slots(const vector<int> &slots);
+
+private:
+	int ncapacity;
+	int blocksize;
+	/* Slot storage: slot i holds the block data[i * blocksize .. (i + 1) * blocksize) */
+	vector<char> storage;
+	vector<int> slotBlock;
+	vector<bool> slotDirty;
+	/* Most recently used slots are on the front */
+	list<int> lru;
+	vector<list<int>::iterator> slotPosition;
+	vector<int> freeSlots;
+	unordered_map<int, int> index;
+	writeback_fn writeback;
+
+	int ndirty;
+	int nhits;
+	int nmisses;
+	int nevictions;
+};
+
+#endif
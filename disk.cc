@@ -1,24 +1,58 @@
 #include "disk.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-Disk::Disk(const char *filename, int n)
+Disk::Disk(const char *filename, int n, int cacheblocks, bool mapped, bool uring)
+	/* The mapping already keeps every block in memory, so the block cache would only add a copy */
+	: blockSize(DEFAULT_BLOCK_SIZE), cache(mapped ? 0 : cacheblocks, DEFAULT_BLOCK_SIZE,
+			[this](int blocknum, const vector<const char *> &blocks) { stage_write(blocknum, blocks); })
 {
-	diskfile = fopen(filename, "r+");
+	mapping = 0;
+	writingBack = 0;
+	stopping = false;
+	imageBytes = (long long)n * blockSize;
+	cacheBytes = (long long)cache.capacity() * blockSize;
+	diskfd = open(filename, O_RDWR | O_CREAT, 0666);
+	/* Also when the file couldn't be opened: the requests then fail as they used to */
+	io = new AsyncIO(diskfd, AsyncIO::DEFAULT_QUEUE_DEPTH, uring);
 
-	if (!diskfile)
-		diskfile = fopen(filename, "w+");
-
-	if (!diskfile)
+	if (diskfd < 0)
 	{
 		cout << "Error when opening the file " << filename << "\n";
 		return;
 	}
 
-	ftruncate(fileno(diskfile), n * DISK_BLOCK_SIZE);
+	ftruncate(diskfd, (off_t)imageBytes);
+
+	if (mapped)
+	{
+		void *address = mmap(0, (size_t)imageBytes, PROT_READ | PROT_WRITE, MAP_SHARED, diskfd, 0);
+		if (address == MAP_FAILED)
+		{
+			cout << "Error when mapping the file " << filename << ", using regular I/O instead\n";
+		}
+		else
+		{
+			mapping = (char *)address;
+		}
+	}
 
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
+	nrequests = 0;
+	nprefetched = 0;
+	writeback = false;
+	dirtyLimit = DEFAULT_DIRTY_BYTES / blockSize;
+}
+
+Disk::~Disk()
+{
+	stop_prefetch();
 }
 
 int Disk::size()
@@ -26,6 +60,44 @@ int Disk::size()
 	return nblocks;
 }
 
+int Disk::block_size()
+{
+	return blockSize;
+}
+
+bool Disk::set_block_size(int bytes)
+{
+	if (bytes < MIN_BLOCK_SIZE || bytes > MAX_BLOCK_SIZE || (bytes & (bytes - 1)) != 0)
+	{
+		return false;
+	}
+	/* Block numbers are ints, so a large image can't be split into small blocks */
+	if (imageBytes / bytes > INT_MAX)
+	{
+		cout << "Error: the image has more than " << INT_MAX << " blocks of " << bytes << " bytes\n";
+		return false;
+	}
+
+	unique_lock<mutex> guard(diskLock);
+	if (bytes == blockSize)
+	{
+		return true;
+	}
+
+	/* Whatever is dirty or on its way goes out in the old size first */
+	flush_cache(guard);
+	while (writingBack > 0 || !inFlight.empty())
+	{
+		transferred.wait(guard);
+	}
+
+	blockSize = bytes;
+	nblocks = (int)(imageBytes / blockSize);
+	cache.resize(cacheBytes > 0 ? max(1LL, cacheBytes / blockSize) : 0, blockSize);
+	dirtyLimit = DEFAULT_DIRTY_BYTES / blockSize;
+	return true;
+}
+
 void Disk::sanity_check(int blocknum, const void *data)
 {
 	if (blocknum < 0)
@@ -49,46 +121,553 @@ void Disk::sanity_check(int blocknum, const void *data)
 
 void Disk::read(int blocknum, char *data)
 {
-	sanity_check(blocknum, data);
+	read_blocks(vector<int>(1, blocknum), vector<char *>(1, data));
+}
 
-	fseek(diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET);
+void Disk::write(int blocknum, const char *data)
+{
+	write_blocks(vector<int>(1, blocknum), vector<const char *>(1, data));
+}
 
-	if (fread(data, DISK_BLOCK_SIZE, 1, diskfile) == 1)
+void Disk::read_blocks(int blocknum, int count, char *data)
+{
+	vector<int> blocknums;
+	vector<char *> buffers;
+	for (int i = 0; i < count; i++)
 	{
-		nreads++;
+		blocknums.push_back(blocknum + i);
+		buffers.push_back(data + (size_t)i * blockSize);
 	}
-	else
+	read_blocks(blocknums, buffers);
+}
+
+void Disk::write_blocks(int blocknum, int count, const char *data)
+{
+	vector<int> blocknums;
+	vector<const char *> buffers;
+	for (int i = 0; i < count; i++)
 	{
-		cout << "ERROR: couldn't access simulated disk\n";
-		abort();
+		blocknums.push_back(blocknum + i);
+		buffers.push_back(data + (size_t)i * blockSize);
 	}
+	write_blocks(blocknums, buffers);
 }
 
-void Disk::write(int blocknum, const char *data)
+void Disk::read_blocks(const vector<int> &blocknums, const vector<char *> &data)
 {
-	sanity_check(blocknum, data);
+	for (size_t i = 0; i < blocknums.size(); i++)
+	{
+		sanity_check(blocknums[i], data[i]);
+	}
 
-	fseek(diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET);
+	unique_lock<mutex> guard(diskLock);
 
-	if (fwrite(data, DISK_BLOCK_SIZE, 1, diskfile) == 1)
+	/*
+	* Blocks some other request is transferring are waited for and looked up again, since a read of
+	* them caches them as it finishes.
+	*/
+	vector<bool> found(blocknums.size(), false);
+	vector<size_t> missing;
+	while (true)
 	{
-		nwrites++;
+		bool busy = false;
+		missing.clear();
+		for (size_t i = 0; i < blocknums.size(); i++)
+		{
+			if (found[i])
+			{
+				continue;
+			}
+			if (cache.lookup(blocknums[i], data[i]))
+			{
+				found[i] = true;
+				continue;
+			}
+			busy = busy || inFlight.count(blocknums[i]);
+			missing.push_back(i);
+		}
+		if (!busy)
+		{
+			break;
+		}
+		transferred.wait(guard);
 	}
-	else
+
+	if (missing.empty())
 	{
-		cout << "ERROR: couldn't access simulated disk\n";
-		abort();
+		return;
+	}
+	for (size_t i = 0; i < missing.size(); i++)
+	{
+		inFlight.insert(blocknums[missing[i]]);
+	}
+	guard.unlock();
+
+	/* Only the blocks that aren't cached go to the image file, adjacent ones in a single request */
+	atomic<int> remaining(0);
+	int requests = 0;
+	vector<char *> run;
+	int runStart = 0;
+	for (size_t i = 0; i < missing.size(); i++)
+	{
+		int blocknum = blocknums[missing[i]];
+		if (!run.empty() && blocknum != runStart + (int)run.size())
+		{
+			requests += submit_read(runStart, run, remaining);
+			run.clear();
+		}
+		if (run.empty())
+		{
+			runStart = blocknum;
+		}
+		run.push_back(data[missing[i]]);
+	}
+	requests += submit_read(runStart, run, remaining);
+	/* Every run was in flight at the same time */
+	wait_io(remaining);
+
+	guard.lock();
+	/* Only caches after everything was read, so the cache never hands out a block still being read */
+	for (size_t i = 0; i < missing.size(); i++)
+	{
+		cache.insert(blocknums[missing[i]], data[missing[i]]);
+		inFlight.erase(blocknums[missing[i]]);
+	}
+	nreads += missing.size();
+	nrequests += requests;
+	transferred.notify_all();
+	write_staged(guard);
+}
+
+void Disk::write_blocks(const vector<int> &blocknums, const vector<const char *> &data)
+{
+	for (size_t i = 0; i < blocknums.size(); i++)
+	{
+		sanity_check(blocknums[i], data[i]);
+	}
+
+	unique_lock<mutex> guard(diskLock);
+	wait_blocks(blocknums, guard);
+
+	if (writeback && cache.capacity() > 0)
+	{
+		/* Write-back: blocks only reach the image file on sync, eviction or when too much is dirty */
+		for (size_t i = 0; i < blocknums.size(); i++)
+		{
+			cache.insert(blocknums[i], data[i], true);
+		}
+		if (cache.dirty_blocks() >= dirtyLimit)
+		{
+			cache.flush();
+		}
+		write_staged(guard);
+		return;
+	}
+
+	/* Write-through: the cached copies are brought up to date before the blocks go out */
+	for (size_t i = 0; i < blocknums.size(); i++)
+	{
+		cache.insert(blocknums[i], data[i]);
+		inFlight.insert(blocknums[i]);
+	}
+	guard.unlock();
+
+	/* Adjacent blocks go out in a single request */
+	atomic<int> remaining(0);
+	int requests = 0;
+	vector<const char *> run;
+	int runStart = 0;
+	for (size_t i = 0; i < blocknums.size(); i++)
+	{
+		if (!run.empty() && blocknums[i] != runStart + (int)run.size())
+		{
+			requests += submit_write(runStart, run, remaining);
+			run.clear();
+		}
+		if (run.empty())
+		{
+			runStart = blocknums[i];
+		}
+		run.push_back(data[i]);
+	}
+	if (!run.empty())
+	{
+		requests += submit_write(runStart, run, remaining);
+	}
+	wait_io(remaining);
+
+	guard.lock();
+	for (size_t i = 0; i < blocknums.size(); i++)
+	{
+		inFlight.erase(blocknums[i]);
 	}
+	nwrites += blocknums.size();
+	nrequests += requests;
+	transferred.notify_all();
+	write_staged(guard);
+}
+
+void Disk::prefetch(const vector<int> &blocknums)
+{
+	/* Nothing to gain when there is no cache to keep the blocks */
+	if (mapping || cache.capacity() == 0)
+	{
+		return;
+	}
+
+	for (size_t i = 0; i < blocknums.size(); i++)
+	{
+		sanity_check(blocknums[i], this);
+	}
+
+	unique_lock<mutex> guard(diskLock);
+	if (stopping || diskfd < 0)
+	{
+		return;
+	}
+
+	/* Blocks another request is already transferring are left to it, nothing waits for a prefetch */
+	vector<int> missing;
+	for (size_t i = 0; i < blocknums.size(); i++)
+	{
+		if (!cache.contains(blocknums[i]) && !inFlight.count(blocknums[i]))
+		{
+			missing.push_back(blocknums[i]);
+			inFlight.insert(blocknums[i]);
+		}
+	}
+	if (missing.empty())
+	{
+		return;
+	}
+
+	prefetchQueue.push_back(move(missing));
+	if (!prefetcher.joinable())
+	{
+		prefetcher = thread(&Disk::prefetch_worker, this);
+	}
+	prefetchQueued.notify_one();
+}
+
+void Disk::prefetch_worker()
+{
+	unique_lock<mutex> guard(diskLock);
+	while (true)
+	{
+		while (prefetchQueue.empty() && !stopping)
+		{
+			prefetchQueued.wait(guard);
+		}
+		if (prefetchQueue.empty())
+		{
+			return;
+		}
+		vector<int> missing = move(prefetchQueue.front());
+		prefetchQueue.pop_front();
+		guard.unlock();
+
+		/* Adjacent missing blocks are read with a single request, all of the requests in flight together */
+		vector<char> storage(missing.size() * blockSize);
+		vector<char *> buffers;
+		for (size_t i = 0; i < missing.size(); i++)
+		{
+			buffers.push_back(&storage[i * blockSize]);
+		}
+
+		atomic<int> remaining(0);
+		int requests = 0;
+		size_t runStart = 0;
+		while (runStart < missing.size())
+		{
+			size_t runEnd = runStart + 1;
+			while (runEnd < missing.size() && missing[runEnd] == missing[runEnd - 1] + 1)
+			{
+				runEnd++;
+			}
+			requests += submit_read(missing[runStart], vector<char *>(buffers.begin() + runStart, buffers.begin() + runEnd), remaining);
+			runStart = runEnd;
+		}
+		wait_io(remaining);
+
+		guard.lock();
+		for (size_t i = 0; i < missing.size(); i++)
+		{
+			cache.insert(missing[i], buffers[i]);
+			inFlight.erase(missing[i]);
+		}
+		nreads += missing.size();
+		nrequests += requests;
+		nprefetched += missing.size();
+		transferred.notify_all();
+		write_staged(guard);
+	}
+}
+
+void Disk::stop_prefetch()
+{
+	/* Whatever was queued is read first, since its blocks are marked in flight until then */
+	unique_lock<mutex> guard(diskLock);
+	stopping = true;
+	prefetchQueued.notify_one();
+	guard.unlock();
+	if (prefetcher.joinable())
+	{
+		prefetcher.join();
+	}
+}
+
+int Disk::cache_blocks()
+{
+	return cache.capacity();
+}
+
+void Disk::wait_blocks(const vector<int> &blocknums, unique_lock<mutex> &guard)
+{
+	for (size_t i = 0; i < blocknums.size(); i++)
+	{
+		while (inFlight.count(blocknums[i]))
+		{
+			transferred.wait(guard);
+		}
+	}
+}
+
+void Disk::stage_write(int blocknum, const vector<const char *> &blocks)
+{
+	/*
+	* Called by the cache, with diskLock held, for dirty blocks it evicts or flushes. They're marked
+	* as in flight right away, so nobody reads the older copy from the image file in the meantime.
+	*/
+	disk_run run;
+	run.blocknum = blocknum;
+	run.data.resize(blocks.size() * blockSize);
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		memcpy(&run.data[i * blockSize], blocks[i], blockSize);
+		inFlight.insert(blocknum + i);
+	}
+	staged.push_back(move(run));
+}
+
+void Disk::write_staged(unique_lock<mutex> &guard)
+{
+	/* Writes what the cache handed back while the lock was held, with the lock released */
+	if (staged.empty())
+	{
+		return;
+	}
+
+	vector<disk_run> runs;
+	runs.swap(staged);
+	writingBack++;
+	guard.unlock();
+
+	/* Every run in flight at the same time */
+	atomic<int> remaining(0);
+	int requests = 0;
+	int blocks = 0;
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		vector<const char *> run;
+		for (size_t offset = 0; offset < runs[i].data.size(); offset += blockSize)
+		{
+			run.push_back(&runs[i].data[offset]);
+		}
+		requests += submit_write(runs[i].blocknum, run, remaining);
+		blocks += run.size();
+	}
+	wait_io(remaining);
+
+	guard.lock();
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		for (size_t block = 0; block < runs[i].data.size() / blockSize; block++)
+		{
+			inFlight.erase(runs[i].blocknum + block);
+		}
+	}
+	nwrites += blocks;
+	nrequests += requests;
+	writingBack--;
+	transferred.notify_all();
+}
+
+int Disk::submit_read(int blocknum, const vector<char *> &data, atomic<int> &remaining)
+{
+	if (mapping)
+	{
+		for (size_t i = 0; i < data.size(); i++)
+		{
+			memcpy(data[i], mapping + (size_t)(blocknum + i) * blockSize, blockSize);
+		}
+		return 0;
+	}
+
+	/* A single preadv per IOV_MAX blocks, each block landing straight in its own buffer */
+	int requests = 0;
+	for (size_t done = 0; done < data.size(); done += IOV_MAX)
+	{
+		size_t count = min(data.size() - done, (size_t)IOV_MAX);
+		vector<struct iovec> iov(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			iov[i].iov_base = data[done + i];
+			iov[i].iov_len = blockSize;
+		}
+
+		off_t position = (off_t)(blocknum + done) * blockSize;
+		ssize_t expected = count * blockSize;
+		remaining++;
+		io->submit_read(iov, position, [expected, &remaining](ssize_t result) {
+			if (result != expected)
+			{
+				cout << "ERROR: couldn't access simulated disk\n";
+				abort();
+			}
+			remaining--;
+		});
+		requests++;
+	}
+	return requests;
+}
+
+int Disk::submit_write(int blocknum, const vector<const char *> &data, atomic<int> &remaining)
+{
+	if (mapping)
+	{
+		for (size_t i = 0; i < data.size(); i++)
+		{
+			memcpy(mapping + (size_t)(blocknum + i) * blockSize, data[i], blockSize);
+		}
+		return 0;
+	}
+
+	int requests = 0;
+	for (size_t done = 0; done < data.size(); done += IOV_MAX)
+	{
+		size_t count = min(data.size() - done, (size_t)IOV_MAX);
+		vector<struct iovec> iov(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			iov[i].iov_base = (void *)data[done + i];
+			iov[i].iov_len = blockSize;
+		}
+
+		off_t position = (off_t)(blocknum + done) * blockSize;
+		ssize_t expected = count * blockSize;
+		remaining++;
+		io->submit_write(iov, position, [expected, &remaining](ssize_t result) {
+			if (result != expected)
+			{
+				cout << "ERROR: couldn't access simulated disk\n";
+				abort();
+			}
+			remaining--;
+		});
+		requests++;
+	}
+	return requests;
+}
+
+void Disk::wait_io(atomic<int> &remaining)
+{
+	/* Only this request's transfers: the others' completions are run along the way, not waited for */
+	if (io)
+	{
+		io->wait([&remaining] { return remaining == 0; });
+	}
+}
+
+const char *Disk::block_pointer(int blocknum)
+{
+	if (!mapping)
+	{
+		return 0;
+	}
+
+	sanity_check(blocknum, mapping);
+	lock_guard<mutex> guard(diskLock);
+	nreads++;
+	return mapping + (size_t)blocknum * blockSize;
+}
+
+bool Disk::is_mapped()
+{
+	return mapping != 0;
+}
+
+void Disk::sync()
+{
+	unique_lock<mutex> guard(diskLock);
+	flush_cache(guard);
+	/* Write-backs other requests started must be on the image too */
+	while (writingBack > 0)
+	{
+		transferred.wait(guard);
+	}
+	guard.unlock();
+
+	/* Down to the device, not only to the kernel: the journal relies on the order of syncs */
+	if (mapping)
+	{
+		msync(mapping, (size_t)imageBytes, MS_SYNC);
+	}
+	else if (diskfd >= 0)
+	{
+		fdatasync(diskfd);
+	}
+}
+
+void Disk::flush_cache(unique_lock<mutex> &guard)
+{
+	/* Dirty runs are written all at once, instead of one after the other */
+	cache.flush();
+	write_staged(guard);
+
+	if (mapping)
+	{
+		msync(mapping, (size_t)imageBytes, MS_SYNC);
+	}
+}
+
+void Disk::set_writeback(bool enabled)
+{
+	unique_lock<mutex> guard(diskLock);
+	if (!enabled)
+	{
+		flush_cache(guard);
+	}
+	writeback = enabled;
+}
+
+bool Disk::is_writeback()
+{
+	return writeback;
 }
 
 void Disk::close()
 {
-	if (diskfile)
+	stop_prefetch();
+	unique_lock<mutex> guard(diskLock);
+	if (diskfd >= 0)
 	{
+		flush_cache(guard);
 		cout << nreads << " disk block reads\n";
 		cout << nwrites << " disk block writes\n";
-		fclose(diskfile);
-		diskfile = 0;
+		cout << nrequests << " disk I/O requests\n";
+		cout << cache.hits() << " cache hits\n";
+		cout << cache.misses() << " cache misses\n";
+		cout << cache.evictions() << " cache evictions\n";
+		cout << nprefetched << " blocks prefetched\n";
+		if (mapping)
+		{
+			munmap(mapping, (size_t)imageBytes);
+			mapping = 0;
+		}
+		delete io;
+		io = 0;
+		::close(diskfd);
+		diskfd = -1;
 	}
 }
 
@@ -1,9 +1,17 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include "aio.h"
+#include "cache.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <stdio.h>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 using namespace std;
@@ -15,26 +23,123 @@ using namespace std;
 class Disk
 {
 public:
-	static const unsigned short int DISK_BLOCK_SIZE = 4096;
+	/* Block size of a new Disk, which the sizes given to the constructor count in. The file system
+	switches it to its own, a power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE, with set_block_size */
+	static const int DEFAULT_BLOCK_SIZE = 4096;
+	static const int MIN_BLOCK_SIZE = 1024;
+	static const int MAX_BLOCK_SIZE = 65536;
 	static const unsigned int DISK_MAGIC = 0xdeadbeef;
+	/* Number of blocks kept in memory by default (4 MB) */
+	static const int DEFAULT_CACHE_BLOCKS = 4 * 1024 * 1024 / DEFAULT_BLOCK_SIZE;
+	/* Amount of dirty data held in write-back mode before it is flushed (2 MB) */
+	static const int DEFAULT_DIRTY_BYTES = 2 * 1024 * 1024;
 	vector<bool> bitmap;
 
-	Disk(const char *filename, int nblocks);
+	Disk(const char *filename, int nblocks, int cacheblocks = DEFAULT_CACHE_BLOCKS, bool mapped = false, bool uring = true);
+	~Disk();
 
 	int size();
+	int block_size();
+	/*
+	* Splits the image into blocks of 'bytes' from now on, with as many blocks as fit and a cache of
+	* the same size in bytes. Only while nobody else uses the Disk; false if the size isn't valid
+	* or the image would have more than INT_MAX blocks of it.
+	*/
+	bool set_block_size(int bytes);
 	void read(int blocknum, char *data);
 	void write(int blocknum, const char *data);
+
+	/* Contiguous range of 'count' blocks, stored back to back in 'data' */
+	void read_blocks(int blocknum, int count, char *data);
+	void write_blocks(int blocknum, int count, const char *data);
+
+	/* Scatter/gather: block blocknums[i] goes to or comes from data[i] */
+	void read_blocks(const vector<int> &blocknums, const vector<char *> &data);
+	void write_blocks(const vector<int> &blocknums, const vector<const char *> &data);
+
+	/*
+	* Brings blocks into the cache ahead of time, without copying them anywhere else. Returns right
+	* away: a worker thread reads them, and a request for one of them waits until it's cached.
+	*/
+	void prefetch(const vector<int> &blocknums);
+	int cache_blocks();
+
+	/* Only available with the memory-mapped backend, nullptr otherwise */
+	const char *block_pointer(int blocknum);
+	bool is_mapped();
+
+	/* Writes every dirty block and waits until the device has them */
+	void sync();
 	void close();
 	void setBitMap();
 
+	void set_writeback(bool enabled);
+	bool is_writeback();
+
 private:
+	/* Consecutive blocks written back from the cache, copied since their slots are reused right away */
+	class disk_run
+	{
+	public:
+		int blocknum;
+		vector<char> data;
+	};
+
 	void sanity_check(int blocknum, const void *data);
+	void flush_cache(unique_lock<mutex> &guard);
+	void stage_write(int blocknum, const vector<const char *> &blocks);
+	void write_staged(unique_lock<mutex> &guard);
+	void wait_blocks(const vector<int> &blocknums, unique_lock<mutex> &guard);
+	/* Queue the transfer on the async engine, counting it in 'remaining' until it completes; return the system calls used */
+	int submit_read(int blocknum, const vector<char *> &data, atomic<int> &remaining);
+	int submit_write(int blocknum, const vector<const char *> &data, atomic<int> &remaining);
+	void wait_io(atomic<int> &remaining);
+	void prefetch_worker();
+	void stop_prefetch();
 
 private:
-	FILE *diskfile;
+	int diskfd;
 	int nblocks;
+	int blockSize;
+	/* Set when opening, whatever the block size, as is the size of the cache in bytes */
+	long long imageBytes;
+	long long cacheBytes;
 	int nreads;
 	int nwrites;
+	/* System calls issued to the image file; one request may move many blocks */
+	int nrequests;
+	int nprefetched;
+	/* Whole image file mapped in memory, when using the memory-mapped backend */
+	char *mapping;
+	/* Every request to the image file goes through it, so independent runs of blocks are in flight together */
+	AsyncIO *io;
+	BlockCache cache;
+	bool writeback;
+	int dirtyLimit;
+	/*
+	* Guards the cache, the counters and the blocks in flight, but is released during the transfers
+	* themselves so that requests from different threads reach the image file at the same time.
+	*/
+	mutex diskLock;
+	/*
+	* Blocks being read or written with diskLock released. Any other request for one of them waits
+	* on 'transferred' first, so a block is never fetched twice, writes of a block reach the image in
+	* order, and a read never caches a copy older than a write that started after it.
+	*/
+	unordered_set<int> inFlight;
+	condition_variable transferred;
+	/* Written back from the cache by the current holder of diskLock, not yet submitted */
+	vector<disk_run> staged;
+	/* Cache write-backs submitted and not yet done, which sync has to wait for */
+	int writingBack;
+	/*
+	* Blocks handed to prefetch, already marked in flight, for the worker to read through the async
+	* engine. It's started by the first prefetch and stopped by close, once it has read them all.
+	*/
+	deque<vector<int>> prefetchQueue;
+	condition_variable prefetchQueued;
+	thread prefetcher;
+	bool stopping;
 };
 
 #endif
\ No newline at end of file
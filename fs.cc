@@ -6,14 +6,45 @@
 #include <string.h>
 // std::find for vectors
 #include <bits/stdc++.h>
+#include <chrono>
+#include <thread>
 
-int INE5412_FS::fs_format()
+/* Splits [0, count) in one contiguous range per worker and runs them in parallel, the first one in the calling thread */
+static void run_workers(int count, int nworkers, const std::function<void(int worker, int begin, int end)> &work)
+{
+	std::vector<std::thread> threads;
+	for (int w = 1; w < nworkers; w++)
+	{
+		int begin = (int)((long long)count * w / nworkers);
+		int end = (int)((long long)count * (w + 1) / nworkers);
+		threads.emplace_back(work, w, begin, end);
+	}
+	work(0, 0, (int)((long long)count / nworkers));
+
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* Names of the inode pointers by their number of indirect levels */
+static const char *const LEVEL_NAMES[] = {"direct", "indirect", "double indirect", "triple indirect"};
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::fs_format(const fs_format_options &options)
 {
 
 	/*
 	* Rebuild all the blocks: super, inodes and data.
 	*/
 
+	std::unique_lock<std::shared_mutex> mountGuard(mountLock);
+
 	/* Checks if the file system is already mounted */
 	if (isMounted)
 	{
@@ -22,74 +53,131 @@ int INE5412_FS::fs_format()
 	}
 
 	int diskSize = disk->size();
+	int inodesPerInodeBlock = options.inlineData ? INLINE_INODES_PER_BLOCK : INODES_PER_BLOCK;
 
 	/* Calculates the number of blocks reserved for inodes (10% of total blocks),
-	* rounded up.
+	* rounded up, or enough of them for one inode every options.bytesPerInode bytes of disk.
+	* Inode numbers are ints, so the 10% stops at the last block whose inodes all have one.
 	*/
-	int n_inodeBlocks = std::ceil(diskSize * 0.1);
-
-	/* Initializes and writes the superblock -> first block of the disk */
-	fs_superblock superblock;
-	superblock.magic = FS_MAGIC;
-	superblock.nblocks = diskSize;
-	superblock.ninodeblocks = n_inodeBlocks;
-	superblock.ninodes = n_inodeBlocks * INODES_PER_BLOCK;
+	int maxInodeBlocks = INT_MAX / inodesPerInodeBlock;
+	int n_inodeBlocks = min((int)std::ceil(diskSize * 0.1), maxInodeBlocks);
+	if (options.bytesPerInode > 0)
+	{
+		long long inodes = (long long)diskSize * BLOCK_SIZE / options.bytesPerInode;
+		long long inodeBlocks = max(1LL, (inodes + inodesPerInodeBlock - 1) / inodesPerInodeBlock);
+		if (inodeBlocks > maxInodeBlocks)
+		{
+			cout << "Error: Inode ratio gives more than " << INT_MAX << " inodes." << endl;
+			return 0;
+		}
+		n_inodeBlocks = (int)inodeBlocks;
+		if (n_inodeBlocks >= diskSize)
+		{
+			cout << "Error: Inode ratio leaves no room for data." << endl;
+			return 0;
+		}
+	}
 
-	union fs_block superblockUnion;
-	superblockUnion.super = superblock;
-	disk->write(0, superblockUnion.data);
+	/* Initializes the superblock -> first block of the disk */
+	fs_superblock newSuperblock;
+	newSuperblock.magic = FS_MAGIC;
+	newSuperblock.nblocks = diskSize;
+	newSuperblock.ninodeblocks = n_inodeBlocks;
+	newSuperblock.ninodes = n_inodeBlocks * inodesPerInodeBlock;
+	newSuperblock.version = FS_VERSION;
+	newSuperblock.flags = FS_CLEAN | (options.extents ? FS_EXTENTS : 0) | (options.inlineData ? FS_INLINE : 0);
+	newSuperblock.ninitinodeblocks = options.lazyInit ? 0 : n_inodeBlocks;
+	newSuperblock.blocksize = BLOCK_SIZE;
+
+	/* The free-block and free-inode bitmaps are stored right after the inode blocks, one bit per block/inode */
+	int bitsPerBlock = BLOCK_SIZE * 8;
+	newSuperblock.bitmapstart = n_inodeBlocks + 1;
+	newSuperblock.nbitmapblocks = (diskSize + bitsPerBlock - 1) / bitsPerBlock;
+	newSuperblock.ninodebitmapblocks = (int)(((long long)newSuperblock.ninodes + bitsPerBlock - 1) / bitsPerBlock);
+
+	/* The journal follows the bitmaps: 1/64 of the disk, between 16 and JOURNAL_MAX_BLOCKS blocks */
+	newSuperblock.journalstart = newSuperblock.bitmapstart + newSuperblock.nbitmapblocks + newSuperblock.ninodebitmapblocks;
+	newSuperblock.njournalblocks = 0;
+	if (diskSize >= JOURNAL_MIN_DISK_BLOCKS)
+	{
+		newSuperblock.njournalblocks = min((int)JOURNAL_MAX_BLOCKS, max(16, diskSize / 64));
+	}
 
-	/* Following the n_inodeBlocks, it sets each inode to the default values.
-	* Iterates over disk blocks reserved for inodes.
-	*/
-	for (int i = 1; i <= n_inodeBlocks + 1; ++i)
+	/* From now on every operation uses the in-memory copy */
+	if (!load_superblock(newSuperblock))
 	{
-		union fs_block block;
+		cout << "Error: Disk is too small to be formatted." << endl;
+		return 0;
+	}
 
-		/* Iterates over each inode in the current block */
-		for (int j = 0; j < INODES_PER_BLOCK; j++)
-		{
-			block.inode[j].isvalid = 0;
-			block.inode[j].size = 0;
+	/* Nothing cached from a previous file system is valid anymore */
+	inodeCache.clear();
+	readaheadState.clear();
+	journalBlocks.clear();
 
-			/* Iterates over each pointer in current inode  and sets the direct pointers */
-			for (int k = 0; k < POINTERS_PER_INODE; k++)
-			{
-				block.inode[j].direct[k] = 0;
-			}
+	/* Following the n_inodeBlocks, it sets each inode to the default values: invalid, size 0 and
+	* no pointers, which is an all-zero record whatever the inode size.
+	* A lazy format leaves that to the mounts that follow, see init_inode_blocks.
+	*/
+	zero_inode_blocks(0, newSuperblock.ninitinodeblocks);
 
-			/* Sets inderect pointer */
-			block.inode[j].indirect = 0;
-		}
-		disk->write(i, block.data);
+	/* Initialize and setting bitmap as the initial state, which is also stored on disk */
+	instantiate_bitmap();
+	save_bitmaps();
+	dirtyBitmapBlocks.clear();
+	if (has_journal())
+	{
+		journal_clear();
 	}
 
-	/* Initialize and setting bitmap as the initial state */
-	instantiate_bitmap();
+	/* The superblock goes last, so it's only valid once everything it describes is on disk */
+	write_superblock();
+	disk->sync();
 
 	return 1;
 }
 
-void INE5412_FS::fs_debug()
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::fs_debug()
 {
+	std::unique_lock<std::shared_mutex> mountGuard(mountLock);
+
 	if (!isMounted)
 	{
 		cout << "Error: File system is not mounted. Cannot delete." << endl;
 		return;
 	}
 
-	union fs_block block;
-
-	/* Reads block 0 of disk and puts into block variable. */
-	disk->read(0, block.data);
+	/* The inode table is read from disk, so it must have every committed change */
+	{
+		std::lock_guard<std::mutex> journalGuard(journalLock);
+		journal_commit();
+	}
 
 	cout << "superblock:\n";
-	cout << "    " << (block.super.magic == FS_MAGIC ? "magic number is valid\n" : "magic number is invalid!\n");
-	cout << "    " << block.super.nblocks << " blocks\n";
-	cout << "    " << block.super.ninodeblocks << " inode blocks\n";
-	cout << "    " << block.super.ninodes << " inodes\n";
+	cout << "    " << (superblock.magic == FS_MAGIC ? "magic number is valid\n" : "magic number is invalid!\n");
+	cout << "    " << superblock.nblocks << " blocks\n";
+	if (superblock.version >= FS_VERSION_BLOCK_SIZE)
+	{
+		cout << "    " << superblock.blocksize << " bytes per block\n";
+	}
+	cout << "    " << superblock.ninodeblocks << " inode blocks\n";
+	cout << "    " << superblock.ninodes << " inodes\n";
+	if (superblock.flags & FS_EXTENTS)
+	{
+		cout << "    new files use extents\n";
+	}
+	if (superblock.flags & FS_INLINE)
+	{
+		cout << "    small files are stored inline\n";
+	}
+	if (initializedInodeBlocks < superblock.ninodeblocks)
+	{
+		cout << "    " << initializedInodeBlocks << " inode blocks initialized\n";
+	}
 
-	int n_inodeBlocks = block.super.ninodeblocks;
+	/* The rest of a lazily formatted table has nothing to show yet */
+	int n_inodeBlocks = initializedInodeBlocks;
 
 	/* Iterates over blocks reserved to store inodes */
 	for (int i = 0; i < n_inodeBlocks; i++)
@@ -99,13 +187,45 @@ void INE5412_FS::fs_debug()
 		disk->read(i + 1, inodeBlock.data);
 
 		/* Iterates over inodes of the current block */
-		for (int j = 0; j < INODES_PER_BLOCK; j++)
+		for (int j = 0; j < inodesPerBlock; j++)
 		{
-			if (inodeBlock.inode[j].isvalid)
+			fs_inode inode;
+			decode_inode(inodeBlock, j, inode);
+			if (inode.isvalid)
 			{
 				//////// 1. PRINT INODE INFO ////////
-				cout << "inode " << (i * INODES_PER_BLOCK + j) + 1 << ":" << endl;
-				cout << "    size: " << inodeBlock.inode[j].size << " bytes" << endl;
+				cout << "inode " << (i * inodesPerBlock + j) + 1 << ":" << endl;
+				cout << "    size: " << inode.size << " bytes" << endl;
+
+				if (is_inline_inode(inode))
+				{
+					cout << "    data is inline" << endl;
+					cout << endl;
+					continue;
+				}
+
+				if (is_extent_inode(inode))
+				{
+					std::vector<fs_extent> extents;
+					std::vector<int> nodes;
+					collect_extents(inode, extents, nodes);
+					if (!nodes.empty())
+					{
+						cout << "    extent blocks: ";
+						for (size_t k = 0; k < nodes.size(); k++)
+						{
+							cout << nodes[k] << " ";
+						}
+						cout << endl;
+					}
+					for (size_t k = 0; k < extents.size(); k++)
+					{
+						cout << "    extent: file blocks " << extents[k].fileBlock << "-" << extents[k].fileBlock + extents[k].length - 1;
+						cout << " at blocks " << extents[k].start << "-" << extents[k].start + extents[k].length - 1 << endl;
+					}
+					cout << endl;
+					continue;
+				}
 
 				//////// 2. PRINT INODE DIRECT BLOCKS INFO ////////
 				
@@ -113,29 +233,35 @@ void INE5412_FS::fs_debug()
 				/* Iterates over direct blocks */
 				for (int k = 0; k < POINTERS_PER_INODE; k++)
 				{
-					if (inodeBlock.inode[j].direct[k] != 0)
+					if (inode.direct[k] != 0)
 					{
 						if (!wasPrinted) {
 							cout << "    direct blocks: ";
 						}
-						cout << inodeBlock.inode[j].direct[k] << " ";
+						cout << inode.direct[k] << " ";
 						wasPrinted = true;
 					}
 				}
 				cout << endl;
 				//////// 3. PRINT INODE INDIRECT BLOCKS INFO ////////
-				if (inodeBlock.inode[j].indirect != 0)
+				int usedBlocks = size_blocks(inode.size);
+				for (int level = 1; level <= inode_levels(); level++)
 				{
-					cout << "    indirect block: " << inodeBlock.inode[j].indirect << endl;
-					cout << "    indirect data blocks: ";
-					// /* Reads and iterates over indirect blocks */
-					union fs_block indirectBlock;
-					disk->read(inodeBlock.inode[j].indirect, indirectBlock.data);
-
-					for (int k = 0; k < POINTERS_PER_BLOCK; k++)
+					if (inode.root(level) == 0)
+					{
+						continue;
+					}
+					cout << "    " << LEVEL_NAMES[level] << " block: " << inode.root(level) << endl;
+					cout << "    " << LEVEL_NAMES[level] << " data blocks: ";
+
+					/* Found through the same translation as reads and writes */
+					std::vector<int> pointers;
+					int lastBlock = min(usedBlocks, level_first_block(level + 1)) - 1;
+					collect_data_pointers(inode, level_first_block(level), lastBlock, pointers);
+					for (size_t k = 0; k < pointers.size(); k++)
 					{
-						if (indirectBlock.pointers[k] != 0)
-							cout << indirectBlock.pointers[k] << " ";
+						if (pointers[k] != 0)
+							cout << pointers[k] << " ";
 					}
 					cout << endl;
 				}
@@ -145,13 +271,16 @@ void INE5412_FS::fs_debug()
 	}
 }
 
-int INE5412_FS::fs_mount()
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::fs_mount()
 {
 	/*
 	Examina o disco para um sistema de arquivos. Se um está presente, lê o superbloco, constrói um
 	bitmap de blocos livres, e prepara o sistema de arquivos para uso. Retorna um em caso de sucesso, zero
 	caso contrário. Note que uma montagem bem-sucedida é um pré-requisito para as outras chamadas
 	*/
+	std::unique_lock<std::shared_mutex> mountGuard(mountLock);
+
 	if (isMounted) {
 		/* Stop mount since the disk is already mounted */
 		cout << "The disk is already mounted!";
@@ -159,713 +288,2851 @@ int INE5412_FS::fs_mount()
 	}
 
 
-	union fs_block superblock;
-	/* Reads block 0 of disk and puts into superblock variable. */
-	disk->read(0, superblock.data);
-
-	/* Mounting the disk since the superblock has a valid magic number, therefore it's a valid disk */
-	if (superblock.super.magic == FS_MAGIC) {
-		/* Instantiates initial bitmap */
-		instantiate_bitmap();
-
-		/* Starting of inode loop to set the bitmap at the current state*/
-		int n_inodeBlocks = superblock.super.ninodeblocks;
-		/* Iterates over blocks reserved to store inodes */
-		for (int i = 0; i < n_inodeBlocks; i++)
-		{
-			union fs_block inodeBlock;
-			/* Reads block i+1 of disk and puts into block variable. */
-			disk->read(i + 1, inodeBlock.data);
-
-			/* Iterates over inodes of the current block */
-			for (int j = 0; j < INODES_PER_BLOCK; j++)
-			{
-				if (inodeBlock.inode[j].isvalid)
-				{
-					for (int k = 0; k < POINTERS_PER_INODE; k++)
-					{
-						int blockIndex = inodeBlock.inode[j].direct[k];
-						if (blockIndex != 0) {
-							/* Setting 1 for direct blocks referenced on inode on bitmap */
-							set_bitmap_bit_by_index(1, blockIndex);
-						}
-					}
-
-					// Iterating in indirect block pointers
-					if (inodeBlock.inode[j].indirect != 0)
-					{
-						int indirectBlockIndex = inodeBlock.inode[j].indirect;
-						union fs_block indirectBlock;
-						disk->read(indirectBlockIndex, indirectBlock.data);
+	union fs_block block;
+	/* Reads block 0 of disk and puts into block variable. This is the only time the superblock is read. */
+	disk->read(0, block.data);
 
-						/* Setting 1 for indirect block on bitmap */
-						set_bitmap_bit_by_index(1, indirectBlockIndex);
+	/* Mounting the disk since the superblock is valid, therefore it's a valid disk */
+	if (load_superblock(block.super)) {
+		/* A transaction that was committed but may not have reached its place on disk before a crash */
+		if (has_journal()) {
+			journal_replay();
+		}
 
-						for (int k = 0; k < POINTERS_PER_BLOCK; k++)
-						{
-							int pointedBlockIndex = indirectBlock.pointers[k];
-							if (indirectBlock.pointers[k] != 0) {
-								/* Setting 1 for blocks referenced on indirect block on bitmap */
-								set_bitmap_bit_by_index(1, pointedBlockIndex);
-							}
-						}
-					}
-				}
+		if (has_bitmap_region() && (superblock.flags & FS_CLEAN)) {
+			/* Clean shutdown: the bitmaps on disk are up to date, so there is no need to scan the inodes */
+			load_bitmaps();
+		} else {
+			if (has_bitmap_region()) {
+				cout << "File system was not unmounted cleanly, rebuilding the bitmaps." << endl;
 			}
+			rebuild_bitmaps();
 		}
+		journalBlocks.clear();
+		dirtyBitmapBlocks.clear();
+		pendingFree.clear();
+
+		/* A lazy format left inode blocks to zero, which goes on in the background while mounted */
+		if (initializedInodeBlocks < superblock.ninodeblocks) {
+			lazyInitStop = false;
+			lazyInitThread = std::thread(&fs_impl::lazy_init_worker, this);
+		}
+
+		/* Until fs_unmount, a crash leaves the file system marked as not clean.
+		Not needed with a journal, since the bitmaps on disk follow every commit */
+		if (has_bitmap_region() && !has_journal()) {
+			superblock.flags &= ~FS_CLEAN;
+			write_superblock();
+			disk->sync();
+		}
+
 		/* Setting boolean value as true if the mount was successful, along with returning 1 */	
 		isMounted = true;
 		return 1;
 	} else {
-		/* Means that the first block in the disk isn't a superblock with a valid magic number, 
+		/* Means that the first block in the disk isn't a valid superblock,
 		and therefore it's an unvalid disk*/
 		cout << "The disk is invalid!";
 		return 0;
 	}
 }
 
-int INE5412_FS::fs_create()
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::fs_unmount()
 {
-	/* 
-	Cria um novo inodo de comprimento zero. Em caso de sucesso, retorna o inúmero (positivo). Em
-	caso de falha, retorna zero. (Note que isto implica que zero não pode ser um inúmero válido.)
-	*/
+	/* Not holding mountLock, which the thread needs to finish its step */
+	stop_lazy_init();
+
+	std::unique_lock<std::shared_mutex> mountGuard(mountLock);
+
 	if (!isMounted) {
 		cout << "File System is not yet mounted!";
 		return 0;
 	}
 
-	union fs_block superblock;
-	disk->read(0, superblock.data);
+	/* The last operations still in the running transaction */
+	if (has_journal()) {
+		std::lock_guard<std::mutex> journalGuard(journalLock);
+		journal_commit();
+	}
 
-	int numberOfInodeBlocks = superblock.super.ninodeblocks;
+	if (has_bitmap_region()) {
+		/* The bitmaps must be on disk before the superblock says they can be trusted */
+		save_bitmaps();
+		disk->sync();
 
-	/* Searching for the first invalid inode */
+		/* Everything in the journal is in place now, it must not be replayed over what comes next */
+		if (has_journal()) {
+			journal_clear();
+		}
+		superblock.flags |= FS_CLEAN;
+		write_superblock();
+	}
+	disk->sync();
 
-	fs_inode inode;
-	inode.isvalid = 0;
-	/* Setting inumber default number as 0, since it's the failure number */
-	int inumber = 0;
+	inodeCache.clear();
+	readaheadState.clear();
+	isMounted = false;
+	return 1;
+}
 
-	for (int i = 0; i < numberOfInodeBlocks; i++)
-	{
-		if (inode.isvalid) {
-			/* Means that an invalid inode was already found on the inner loop below */
-			break;
-		}
+template <int BLOCK_SIZE>
+bool INE5412_FS::fs_impl<BLOCK_SIZE>::is_mounted()
+{
+	std::shared_lock<std::shared_mutex> mountGuard(mountLock);
+	return isMounted;
+}
 
-		union fs_block inodeBlock;
-		disk->read(i + 1, inodeBlock.data);
-		
-		for (int j = 0; j < INODES_PER_BLOCK; j++)
-		{
-			if (inodeBlock.inode[j].isvalid == 0) {
-				inode = inodeBlock.inode[j];
-				
-				inode.isvalid = 1;
-				inode.size = 0;
-				inode.indirect = 0;
-				inode.size = 0;
-				for (int k = 0; k < POINTERS_PER_INODE; k++)
-				{
-					inode.direct[k] = 0;
-				}
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::rebuild_bitmaps()
+{
+	/* Instantiates initial bitmap, with only the metadata blocks in use */
+	instantiate_bitmap();
 
-				inumber = (i * INODES_PER_BLOCK + j) + 1;
-				inodeBlock.inode[j] = inode;
+	/* Each worker scans part of the inode table and then part of the indirect blocks into its own bitmaps */
+	std::vector<fs_scan_worker> workers(scan_workers());
+	scan_inode_table(workers, false);
+	scan_indirect_blocks(workers, false);
+	merge_scan(workers, bitmap, inodeBitmap, nullptr);
+}
 
-				/* Breaking the loop as soon as we find an invalid inode */
-				disk->write(i + 1, inodeBlock.data);
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::zero_inode_blocks(int first, int count)
+{
+	/* A step at a time, so adjacent blocks go out in large requests */
+	std::vector<char> zeros((size_t)min(count, (int)LAZY_INIT_STEP_BLOCKS) * BLOCK_SIZE, 0);
+	for (int done = 0; done < count; done += LAZY_INIT_STEP_BLOCKS)
+	{
+		disk->write_blocks(1 + first + done, min(count - done, (int)LAZY_INIT_STEP_BLOCKS), zeros.data());
+	}
+}
 
-				/* We always update the bitmap number to 1 for the inode block in case of a successful inode creation */
-				set_bitmap_bit_by_index(1, i + 1);
-				break;
-			}
-		}
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::init_inode_blocks(int count)
+{
+	/* Makes the first 'count' inode blocks usable, zeroing the ones a lazy format left behind */
+	std::lock_guard<std::mutex> lazyInitGuard(lazyInitLock);
+	int first = initializedInodeBlocks;
+	if (count <= first)
+	{
+		return;
 	}
 
-	return inumber;
+	/* The zeros are on disk before the superblock counts them, so a scan after a crash never takes
+	old contents for inodes, and the superblock is before any inode created in them */
+	zero_inode_blocks(first, count - first);
+	disk->sync();
+	{
+		std::lock_guard<std::mutex> journalGuard(journalLock);
+		superblock.ninitinodeblocks = count;
+		write_superblock();
+	}
+	disk->sync();
+	initializedInodeBlocks = count;
 }
 
-int INE5412_FS::fs_delete(int inumber)
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::lazy_init_worker()
 {
-	if (!isMounted)
+	/* A step per turn of mountLock, so operations go on in between. One that needs an inode block
+	sooner zeroes it itself, see fs_create */
+	while (!lazyInitStop)
 	{
-		cout << "Error: File system is not mounted. Cannot delete." << endl;
-		return 0;
+		std::shared_lock<std::shared_mutex> mountGuard(mountLock);
+		int initialized = initializedInodeBlocks;
+		if (!isMounted || initialized >= superblock.ninodeblocks)
+		{
+			return;
+		}
+		init_inode_blocks(min(superblock.ninodeblocks, initialized + LAZY_INIT_STEP_BLOCKS));
 	}
+}
 
-	if (inumber < 0)
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::stop_lazy_init()
+{
+	lazyInitStop = true;
+	if (lazyInitThread.joinable())
 	{
-		cout << "Error: Inumber is not valid. " << endl;
-		return 0;
+		lazyInitThread.join();
+	}
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::scan_workers()
+{
+	int nworkers = std::thread::hardware_concurrency();
+	return max(1, min(nworkers, superblock.ninodeblocks));
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::scan_inode_table(std::vector<fs_scan_worker> &workers, bool check)
+{
+	for (size_t w = 0; w < workers.size(); w++)
+	{
+		workers[w].blocks.reset(superblock.nblocks);
+		workers[w].inodes.reset(superblock.ninodes);
 	}
 
-	union fs_block superblock;
-	/* Reads and stores superblock to block variable */
-	disk->read(0, superblock.data);
+	/* The inode table is contiguous, so it's read a batch at a time and the batch split among the workers.
+	Blocks a lazy format didn't zero yet only have free inodes */
+	int tableBlocks = initializedInodeBlocks;
+	int batchSize = max(1, min((int)SCAN_BATCH_BLOCKS, tableBlocks));
+	std::vector<fs_block> inodeBlocks(batchSize);
+	for (int first = 0; first < tableBlocks; first += batchSize)
+	{
+		int count = min(batchSize, tableBlocks - first);
+		disk->read_blocks(first + 1, count, inodeBlocks[0].data);
 
-	int numberOfInodeBlocks = superblock.super.ninodeblocks;
+		run_workers(count * inodesPerBlock, workers.size(), [&](int w, int begin, int end) {
+			for (int i = begin; i < end; i++)
+			{
+				int inumber = first * inodesPerBlock + i + 1;
+				fs_inode inode;
+				decode_inode(inodeBlocks[i / inodesPerBlock], i % inodesPerBlock, inode);
+				scan_inode(workers[w], inumber, inode, check);
+			}
+		});
 
-	if (inumber > superblock.super.ninodes) {
-		cout << "Inumber is invalid. (bigger than the amount of inodes.)" << endl;
-		return 0;
+		/* Mounting warms up the inode cache while it has room, so the first operations don't read the inode table again */
+		for (int i = 0; !check && i < count && inodeCache.size() < INODE_CACHE_BLOCKS; i++)
+		{
+			fs_inode_block &cached = inodeCache[first + i + 1];
+			for (int j = 0; j < inodesPerBlock; j++)
+			{
+				decode_inode(inodeBlocks[i], j, cached.inode[j]);
+			}
+		}
 	}
+}
 
-	bool wasInodeFound = false;
-	/* Iterates over disk blocks reserved to inodes */
-	for (int i = 0; i < numberOfInodeBlocks; i++)
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::scan_indirect_blocks(std::vector<fs_scan_worker> &workers, bool check)
+{
+	/* One round per level: the blocks read in a round give the indirect blocks read in the next one */
+	std::vector<fs_block> indirectBlocks;
+	while (true)
 	{
-		if (wasInodeFound) {
-			/* Avoiding extra iterations after the inode block has been already deleted */
-			break;
+		std::vector<fs_scan_indirect> entries;
+		for (size_t w = 0; w < workers.size(); w++)
+		{
+			entries.insert(entries.end(), workers[w].indirect.begin(), workers[w].indirect.end());
+			workers[w].indirect.clear();
 		}
-		union fs_block inodeBlock;
-		disk->read(i + 1, inodeBlock.data);
+		if (entries.empty())
+		{
+			return;
+		}
+
+		/* In block order, so the batches are made of as many adjacent blocks as possible */
+		sort(entries.begin(), entries.end(), [](const fs_scan_indirect &a, const fs_scan_indirect &b) {
+			return a.block < b.block;
+		});
 
-		/*Iterates over inodes*/
-		for (int j = 0; j < INODES_PER_BLOCK; j++)
+		indirectBlocks.resize(min((int)SCAN_BATCH_BLOCKS, (int)entries.size()));
+		for (size_t first = 0; first < entries.size(); first += indirectBlocks.size())
 		{
-			int currentINumber = (i * INODES_PER_BLOCK + j) + 1;
-			if (currentINumber == inumber)
+			int count = min(indirectBlocks.size(), entries.size() - first);
+			std::vector<int> blocknums;
+			std::vector<char *> buffers;
+			for (int i = 0; i < count; i++)
 			{
-				if (!inodeBlock.inode[j].isvalid) 
-				{
-					cout << "Inode doesn't exist." << endl;
-					return 0;
-				}
-				/* Inode is found */
-				inodeBlock.inode[j].isvalid = 0;
-				inodeBlock.inode[j].size = 0; 
-
-				/* Iterates over direct pointers in inode and set them to zero */
-				for (int k = 0; k < POINTERS_PER_INODE; k++)
-				{
-					if (inodeBlock.inode[j].direct[k] != 0)
-					{
-						int directBlockIndex = inodeBlock.inode[j].direct[k];
-						set_bitmap_bit_by_index(0, directBlockIndex);
-						/* Erasing diect pointers from inode */
-						inodeBlock.inode[j].direct[k] = 0;
-					}
-				}
+				blocknums.push_back(entries[first + i].block);
+				buffers.push_back(indirectBlocks[i].data);
+			}
+			disk->read_blocks(blocknums, buffers);
 
-				if (inodeBlock.inode[j].indirect != 0)
+			run_workers(count, workers.size(), [&](int w, int begin, int end) {
+				for (int i = begin; i < end; i++)
 				{
-					int indirectBlockIndex = inodeBlock.inode[j].indirect;
-					union fs_block indirectBlock;
-					disk->read(indirectBlockIndex, indirectBlock.data);
-
-					/* Iterates over indirect blocks and set them to zero */
-					for (int k = 0; k < POINTERS_PER_BLOCK; k++)
-					{
-						if (indirectBlock.pointers[k] != 0)
-						{
-							int pointedIndirectBlock = indirectBlock.pointers[k];
-							set_bitmap_bit_by_index(0, pointedIndirectBlock);
-						}
-					}
-					/* Erasing indirect pointer from inode */
-					inodeBlock.inode[j].indirect = 0;
-					
-					/* Freeing indirect blocks from bitmap */
-					set_bitmap_bit_by_index(0, indirectBlockIndex);
+					scan_indirect(workers[w], entries[first + i], indirectBlocks[i], check);
 				}
-				disk->write(i + 1, inodeBlock.data);
-				wasInodeFound = true;
-				break;
-			} 
+			});
 		}
 	}
-	return 1;
 }
 
-int INE5412_FS::fs_getsize(int inumber)
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::merge_scan(std::vector<fs_scan_worker> &workers, Bitmap &blocks, Bitmap &inodes, std::vector<std::string> *problems)
 {
-	if (!isMounted) {
-		cout << "File System is not yet mounted!";
-		return -1;
-	}
-
-	union fs_block superblock;
-	/* Reads and stores superblock to block variable */
-	disk->read(0, superblock.data);
+	/* A block found by two workers is referenced twice, but each worker only saw one of the references */
+	std::vector<int> common;
+	for (size_t w = 0; w < workers.size(); w++)
+	{
+		blocks.merge(workers[w].blocks, problems ? &common : nullptr);
+		inodes.merge(workers[w].inodes);
 
-	if (inumber > superblock.super.ninodes || inumber == 0) {
-		cout << "Inumber is invalid. (bigger than the amount of inodes or equals to 0.)" << endl;
-		return -1;
+		if (problems)
+		{
+			problems->insert(problems->end(), workers[w].problems.begin(), workers[w].problems.end());
+		}
 	}
 
-	/* 
-	Finds the exact block and inode index inside of this block
-	This operation will always be valid since we already checked if inumber is valid
-	 */
-	int blockIndex = 1 + inumber / INODES_PER_BLOCK;
-	/* Adding one to the modulo since inumbers always start in 1 */
-	int inodeIndexInBlock = (inumber - 1) % INODES_PER_BLOCK;
-
-	/* Reads the block and stores in block.data */
-	union fs_block blockWithInode;
-	disk->read(blockIndex, blockWithInode.data);
-
-	/* Gets the exact inode requested by the inumber */
-	fs_inode inode = blockWithInode.inode[inodeIndexInBlock];
-	if (inode.isvalid)
+	for (size_t i = 0; problems && i < common.size(); i++)
 	{
-		return inode.size;
+		problems->push_back("block " + std::to_string(common[i]) + " is referenced more than once");
 	}
-	return -1;
 }
 
-int INE5412_FS::fs_read(int inumber, char *data, int length, int offset)
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::scan_inode(fs_scan_worker &worker, int inumber, const fs_inode &inode, bool check)
 {
-	if (!isMounted)
+	if (!inode.isvalid)
 	{
-		cout << "File System is not yet mounted!";
-		return 0;
+		return;
 	}
+	/* Setting 1 for the inode on the free-inode bitmap */
+	worker.inodes.set(inumber - 1);
 
-	union fs_block superblock;
-	/* Reads and stores superblock to block variable */
-	disk->read(0, superblock.data);
-
-	if (inumber > superblock.super.ninodes || inumber == 0)
+	long long maxSize = max_file_size();
+	if (check && (inode.size < 0 || inode.size > maxSize))
 	{
-		cout << "Inumber is invalid. (bigger than the amount of inodes or equals to 0.)" << endl;
-		return 0;
+		worker.problems.push_back("inode " + std::to_string(inumber) + " has an invalid size " + std::to_string(inode.size));
 	}
+	int usedBlocks = size_blocks(min(max(inode.size, 0LL), maxSize));
 
-	/* 
-	Finds the exact block and inode index inside of this block
-	This operation will always be valid since we already checked if inumber is valid
-	 */
-	int blockIndex = 1 + inumber / INODES_PER_BLOCK;
-	/* Adding one to the modulo since inumbers always start in 1 */
-	int inodeIndexInBlock = (inumber - 1) % INODES_PER_BLOCK;
-
-	/* Reads the block and stores in block.data */
-	union fs_block blockWithInode;
-	disk->read(blockIndex, blockWithInode.data);
-
-	/* Gets the exact inode requested by the inumber */
-	fs_inode inode = blockWithInode.inode[inodeIndexInBlock];
-
-	if (!inode.isvalid)
+	/* An inline inode has no blocks */
+	if (is_inline_inode(inode))
 	{
-		cout << "Inode is invalid." << endl;
-		return 0;
+		if (check && inode.size > INLINE_DATA_SIZE)
+		{
+			worker.problems.push_back("inode " + std::to_string(inumber) + " is inline but has " + std::to_string(inode.size) + " bytes");
+		}
+		return;
 	}
 
-	if (offset > inode.size)
+	if (is_extent_inode(inode))
 	{
-		cout << "Offset is invalid (bigger than inode size)." << endl;
-		return 0;
+		fs_extent_block root;
+		load_extent_root(inode, root);
+		if (root.count < 0 || root.count > EXTENTS_PER_INODE || root.depth < 0 || root.depth > EXTENT_MAX_DEPTH)
+		{
+			if (check)
+			{
+				worker.problems.push_back("inode " + std::to_string(inumber) + " has an invalid extent tree");
+			}
+			return;
+		}
+		scan_extents(worker, inumber, inode.size, root, check);
+		return;
 	}
 
-	/*
-	* Offset + length cannot be bigger then inode size.
-	* If that's the case, we adjust length to include everything until the end
-	* of the inode data.
-	*/
-
-	if (offset + length > inode.size)
+	for (int k = 0; k < POINTERS_PER_INODE; k++)
 	{
-		length = inode.size - offset;
+		if (inode.direct[k] != 0)
+		{
+			/* Setting 1 for direct blocks referenced on inode on bitmap */
+			scan_block(worker, inode.direct[k], inumber, check);
+			if (check && k >= usedBlocks)
+			{
+				worker.problems.push_back("inode " + std::to_string(inumber) + " points to block " + std::to_string(inode.direct[k]) + " past its size");
+			}
+		}
 	}
 
-	/* Total read bytes */
-	int readBytes = 0;
-	/* Calculates the starting block for data */
-	int startBlock = offset / Disk::DISK_BLOCK_SIZE;
-	/* Calculates the starting offset within the first block */
-	int startOffset = offset % Disk::DISK_BLOCK_SIZE;
-
-	/* Iterates over direct blocks, starting from the start block index calculated above */
-	for (int i = startBlock; i < POINTERS_PER_INODE; ++i)
+	for (int level = 1; level <= inode_levels(); level++)
 	{
-		if (readBytes == length)
+		int root = inode.root(level);
+		int firstBlock = level_first_block(level);
+		if (root != 0)
 		{
-			break;
+			/* Setting 1 for indirect block on bitmap; its pointers are only read in the second phase */
+			if (scan_block(worker, root, inumber, check))
+			{
+				worker.indirect.push_back({root, inumber, inode.size, level, firstBlock, false});
+			}
+			if (check && usedBlocks <= firstBlock)
+			{
+				worker.problems.push_back("inode " + std::to_string(inumber) + (level == 1 ? " has an " : " has a ") + LEVEL_NAMES[level] + " block but its size doesn't need one");
+			}
 		}
-		/* 
-		* Reads the inode direct block and stores in blockWithInode.data.
-		*/
-		int pointedBlockIndex = blockWithInode.inode[inodeIndexInBlock].direct[i];
-
-		union fs_block pointedBlock;
-		disk->read(pointedBlockIndex, pointedBlock.data);
-
-		/*
-		* Calculates the number of bytes to copy in this block.
-		* The minimum value between the remaining bytes to read and 
-		* the available space in the current data block.
-		*/
-		int bytesToCopy = min(length - readBytes, Disk::DISK_BLOCK_SIZE - startOffset);
-
-		/* Copy data from the block to the output buffer */
-		memcpy(data + readBytes, pointedBlock.data + startOffset, bytesToCopy);
-
-		/* Updates counter and resets startOffset for subsequent blocks */
-		readBytes += bytesToCopy;
-		startOffset = 0;
-		/* We add the start block amount for the second iteration, where it will read a mix of one indirect block and 3 indirect blocks
-		(4 total blocks = 16384 bytes, buffer's size)*/
-		startBlock++;
 	}
+}
 
-	/* Checks if more data needs to be read from the indirect block */
-	if (readBytes < length && blockWithInode.inode[inodeIndexInBlock].indirect != 0)
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::scan_indirect(fs_scan_worker &worker, const fs_scan_indirect &entry, const fs_block &block, bool check)
+{
+	if (entry.extents)
 	{
-		/* 
-		* Reads the inode indirect block and stores in blockWithInode.data.
-		*/
-		int indirectBlockIndex = blockWithInode.inode[inodeIndexInBlock].indirect;
-		union fs_block indirectBlock;
-		disk->read(indirectBlockIndex, indirectBlock.data);
-
-		/* Iterates over indirect blocks */
-		for (int i = (startBlock - POINTERS_PER_INODE); i < POINTERS_PER_BLOCK; ++i)
+		const fs_extent_block &node = block.extents;
+		if (node.magic != EXTENT_MAGIC || node.depth != entry.level || node.count <= 0 || node.count > EXTENTS_PER_BLOCK)
 		{
-			if (readBytes == length)
+			if (check)
 			{
-				break;
+				worker.problems.push_back("inode " + std::to_string(entry.inumber) + " has an invalid extent block " + std::to_string(entry.block));
 			}
-			/* 
-			* Reads the inode data block and stores in blockWithInode.data.
-			*/
-			int indirectPointedBlockIndex = indirectBlock.pointers[i];
-			union fs_block indirectPointedBlock;
-			disk->read(indirectPointedBlockIndex, indirectPointedBlock.data);
-
-			/* 
-			* Calculates the number of bytes to copy in this block.
-			* Added the -0 to adjust the type. Too lazy to search for a better solution rn.
-			*/
-			int bytesToCopy = min(length - readBytes, Disk::DISK_BLOCK_SIZE - 0);
+			return;
+		}
+		scan_extents(worker, entry.inumber, entry.size, node, check);
+		return;
+	}
 
-			/* Copies data from the block to the output buffer */
-			memcpy(data + readBytes, indirectPointedBlock.data, bytesToCopy);
+	long long maxSize = max_file_size();
+	int usedBlocks = size_blocks(min(max(entry.size, 0LL), maxSize));
+	int span = level_span(entry.level);
 
-			/*  Update counters */
-			readBytes += bytesToCopy;
+	for (int k = 0; k < POINTERS_PER_BLOCK; k++)
+	{
+		int pointedBlockIndex = block.pointers[k];
+		int fileBlock = entry.firstBlock + k * span;
+		if (pointedBlockIndex != 0)
+		{
+			/* Setting 1 for blocks referenced on indirect block on bitmap; the ones that are also indirect go to the next round */
+			if (scan_block(worker, pointedBlockIndex, entry.inumber, check) && entry.level > 1)
+			{
+				worker.indirect.push_back({pointedBlockIndex, entry.inumber, entry.size, entry.level - 1, fileBlock, false});
+			}
+			if (check && fileBlock >= usedBlocks)
+			{
+				worker.problems.push_back("inode " + std::to_string(entry.inumber) + " points to block " + std::to_string(pointedBlockIndex) + " past its size");
+			}
 		}
 	}
+}
 
-	return readBytes;
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::scan_extents(fs_scan_worker &worker, int inumber, long long size, const fs_extent_block &node, bool check)
+{
+	long long maxSize = max_file_size();
+	int usedBlocks = size_blocks(min(max(size, 0LL), maxSize));
+
+	for (int i = 0; i < node.count; i++)
+	{
+		const fs_extent &entry = node.extent[i];
+		int previousEnd = (i == 0) ? 0 : node.extent[i - 1].fileBlock + (node.depth == 0 ? node.extent[i - 1].length : 1);
+		if (check && (entry.fileBlock < previousEnd || (node.depth == 0 && entry.length <= 0)))
+		{
+			worker.problems.push_back("inode " + std::to_string(inumber) + " has an invalid or overlapping extent at file block " + std::to_string(entry.fileBlock));
+		}
+
+		if (node.depth > 0)
+		{
+			/* Extent blocks are read in the next round of the second phase, like indirect blocks */
+			if (scan_block(worker, entry.start, inumber, check))
+			{
+				worker.indirect.push_back({entry.start, inumber, size, node.depth - 1, entry.fileBlock, true});
+			}
+			continue;
+		}
+
+		for (int k = 0; k < entry.length; k++)
+		{
+			scan_block(worker, entry.start + k, inumber, check);
+		}
+		if (check && entry.fileBlock + entry.length > usedBlocks)
+		{
+			worker.problems.push_back("inode " + std::to_string(inumber) + " has an extent past its size at file block " + std::to_string(entry.fileBlock));
+		}
+	}
+}
+
+template <int BLOCK_SIZE>
+bool INE5412_FS::fs_impl<BLOCK_SIZE>::scan_block(fs_scan_worker &worker, int blocknum, int inumber, bool check)
+{
+	/* Pointers outside of the data blocks are ignored, they would mark metadata or nothing at all */
+	if (blocknum < firstDataBlock || blocknum >= superblock.nblocks)
+	{
+		if (check)
+		{
+			worker.problems.push_back("inode " + std::to_string(inumber) + " points to block " + std::to_string(blocknum) + ", outside of the data blocks");
+		}
+		return false;
+	}
+
+	if (worker.blocks.get(blocknum))
+	{
+		if (check)
+		{
+			worker.problems.push_back("block " + std::to_string(blocknum) + " is referenced more than once, again by inode " + std::to_string(inumber));
+		}
+		return false;
+	}
+
+	worker.blocks.set(blocknum);
+	return true;
 }
 
-int INE5412_FS::fs_write(int inumber, const char *data, int length, int offset)
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::fs_create()
 {
+	/* 
+	Cria um novo inodo de comprimento zero. Em caso de sucesso, retorna o inúmero (positivo). Em
+	caso de falha, retorna zero. (Note que isto implica que zero não pode ser um inúmero válido.)
+	*/
+	std::shared_lock<std::shared_mutex> mountGuard(mountLock);
+
 	if (!isMounted) {
 		cout << "File System is not yet mounted!";
 		return 0;
 	}
 
-	union fs_block superblock;
-	/* Reads and stores superblock to block variable */
-	disk->read(0, superblock.data);
+	fs_operation operation(this);
 
-	if (inumber > superblock.super.ninodes || inumber == 0) {
-		cout << "Inumber is invalid. (bigger than the amount of inodes or equals to 0.)" << endl;
+	/* The first invalid inode comes from the free-inode bitmap, where bit i stands for inumber i + 1.
+	It's taken right away, so no other create can get the same inode */
+	int freeInode;
+	{
+		std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+		freeInode = inodeBitmap.find_zero(0, superblock.ninodes);
+		if (freeInode != -1)
+		{
+			inodeBitmap.set(freeInode);
+			mark_bitmap_dirty(superblock.bitmapstart + superblock.nbitmapblocks + freeInode / (BLOCK_SIZE * 8));
+		}
+	}
+	if (freeInode == -1)
+	{
+		cout << "There are no free inodes!" << endl;
+		/* Zero is the failure number */
 		return 0;
 	}
 
-	/* 
-	Finds the exact block and inode index inside of this block
-	This operation will always be valid since we already checked if inumber is valid
-	 */
-	int blockWithInodeIndex = 1 + inumber / INODES_PER_BLOCK;
-	/* Adding one to the modulo since inumbers always start in 1 */
-	int inodeIndexInBlock = (inumber - 1) % INODES_PER_BLOCK;
+	int inumber = freeInode + 1;
 
-	/* Reads the block and stores in block.data */
-	union fs_block blockWithInode;
-	disk->read(blockWithInodeIndex, blockWithInode.data);
+	/* After a lazy format, its inode block may still have to be zeroed */
+	int inodeBlock = (inumber - 1) / inodesPerBlock;
+	if (inodeBlock >= initializedInodeBlocks)
+	{
+		init_inode_blocks(min(superblock.ninodeblocks, max(inodeBlock + 1, initializedInodeBlocks + LAZY_INIT_STEP_BLOCKS)));
+	}
 
-	/* Gets the exact inode requested by the inumber */
-	fs_inode inode = blockWithInode.inode[inodeIndexInBlock];
+	std::unique_lock<std::shared_mutex> inodeGuard(inode_lock(inumber));
 
-	if (!inode.isvalid) {
-		cout << "Inode is invalid. Aborting write..." << endl;
+	/* All pointer fields zeroed are also an empty extent tree, and empty inline data */
+	fs_inode inode;
+	inode.isvalid = 1;
+	if (superblock.flags & FS_EXTENTS)
+	{
+		inode.isvalid |= INODE_EXTENTS;
+	}
+	if (superblock.flags & FS_INLINE)
+	{
+		inode.isvalid |= INODE_INLINE;
+	}
+	inode.size = 0;
+	inode.indirect = 0;
+	inode.doubleindirect = 0;
+	inode.tripleindirect = 0;
+	for (int k = 0; k < POINTERS_PER_INODE; k++)
+	{
+		inode.direct[k] = 0;
+	}
+	memset(inode.inlineTail, 0, sizeof(inode.inlineTail));
+	store_inode(inumber, inode);
+	return inumber;
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::fs_delete(int inumber)
+{
+	std::shared_lock<std::shared_mutex> mountGuard(mountLock);
+
+	if (!isMounted)
+	{
+		cout << "Error: File system is not mounted. Cannot delete." << endl;
 		return 0;
 	}
 
-	/* After beginning overriding the current inode (if there's any data anyway), we free all its blocks to the bitmap */
-	if (offset == 0)
+	if (inumber <= 0 || inumber > superblock.ninodes)
 	{
-		/* We only erase the inode on the first iteration, that is, when offset equals to 0. */
-		erase_entire_inode(inumber);
+		cout << "Inumber is invalid. (bigger than the amount of inodes or equals to 0.)" << endl;
+		return 0;
 	}
 
-	int writeOffset = offset;
-	
-	/* Reads the block and stores in block.data */
-	disk->read(blockWithInodeIndex, blockWithInode.data);
+	fs_operation operation(this);
+	std::unique_lock<std::shared_mutex> inodeGuard(inode_lock(inumber));
 
-	/* Gets the exact inode requested by the inumber */
-	inode = blockWithInode.inode[inodeIndexInBlock];
+	/* The inode is found straight from its inumber */
+	fs_inode inode;
+	load_inode(inumber, inode);
+	if (!inode.isvalid) 
+	{
+		cout << "Inode doesn't exist." << endl;
+		return 0;
+	}
 
-	int writtenBytes = 0;
+	/* Every block of the inode goes back to the bitmap */
+	release_inode_blocks(inode, 0);
+	inode.isvalid = 0;
+	inode.size = 0;
+	store_inode(inumber, inode);
 
-	/* 
-	Iterates over direct blocks only in the first iteration.
-	This is because starting from the next iterations (offset > 0), 
-	the direct blocks are already gonna be set and cannot be overriden 
-	*/
-	if (writtenBytes < length)
+	/* Only free once it's invalid on disk, so a create can't hand out an inode still being deleted */
 	{
-		for (int i = 0; i < POINTERS_PER_INODE; ++i)
-		{
-			if (writtenBytes == length)
-			{
-				break;
-			}
+		std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+		inodeBitmap.clear(inumber - 1);
+		mark_bitmap_dirty(superblock.bitmapstart + superblock.nbitmapblocks + (inumber - 1) / (BLOCK_SIZE * 8));
+	}
+	{
+		std::lock_guard<std::mutex> readaheadGuard(readaheadLock);
+		readaheadState.erase(inumber);
+	}
+	return 1;
+}
 
-			if (inode.direct[i] == 0)
-			{
-				/* 
-				If the current pointer of inode points to a null block, we are allocating a free block from the bitmap, 
-				replacing the null pointer to the former free block that will be now used.
-				*/
-				int freeBlockIndex = find_first_free_block();
-				if (freeBlockIndex != -1 )
-				{
-					inode.direct[i] = freeBlockIndex;
-					/* Updating direct pointer of inode from block with the inode */
-
-					union fs_block freeBlock;
-
-					/*
-					* Calculates the number of bytes to copy to this block.
-					* The minimum value between the remaining bytes to read and 
-					* the available space in the current data block.
-					*/
-					int bytesToCopy = min(length - writtenBytes, Disk::DISK_BLOCK_SIZE - 0);
-
-					/* Copy data from the data pointer to the block */
-					memcpy(freeBlock.data, data + writtenBytes, bytesToCopy);
-
-					/* Updates counter and resets startOffset for subsequent blocks */
-					writtenBytes += bytesToCopy;
-					/* After the first write, the next blocks won't have any offset */
-					writeOffset = 0;
-
-					/* Updating the allocated block and updating it on the bitmap */
-					set_bitmap_bit_by_index(1, freeBlockIndex);
-					disk->write(freeBlockIndex, freeBlock.data);
-				} else {
-					cout << "DISK FULL!!!!" << endl;
-					break;
-				}
-			} 
-		}
+template <int BLOCK_SIZE>
+long long INE5412_FS::fs_impl<BLOCK_SIZE>::fs_getsize(int inumber)
+{
+	std::shared_lock<std::shared_mutex> mountGuard(mountLock);
+
+	if (!isMounted) {
+		cout << "File System is not yet mounted!";
+		return -1;
 	}
 
-	/* Checks if more data needs to be written in indirect blocks */
-	if (writtenBytes < length && offset != 0)
-	{
-		/* 
-		If the current pointer of inode points to a null block, we are allocating a free block from the bitmap, 
-		replacing the null pointer to the former free block that will be now used.
-		*/
-		int indirectBlockIndex;
+	if (inumber > superblock.ninodes || inumber <= 0) {
+		cout << "Inumber is invalid. (bigger than the amount of inodes or equals to 0.)" << endl;
+		return -1;
+	}
 
-		if (inode.indirect == 0)
-		{
-			indirectBlockIndex = find_first_free_block();
-			if (indirectBlockIndex == -1 || find_first_free_block() == -1) {
-				cout << "DISK FULL!!!!" << endl;
-				/* If it wasn't possible to allocate any other further free blocks,  then free the indirect block, since it points to nothing */
-			} else {
-				/* If there are further free blocks, continue with the operation, erasing previous pointers in the allocated indirect block */
-				erase_indirect_block(indirectBlockIndex);
-				inode.indirect = indirectBlockIndex;
-			}
-			
-		} else {
-			indirectBlockIndex = inode.indirect;
-		}
-		
-		if (indirectBlockIndex == -1 ) {
-			cout << "DISK FULL!!!!" << endl;
-		} else {
-			inode.indirect = indirectBlockIndex;
+	std::shared_lock<std::shared_mutex> inodeGuard(inode_lock(inumber));
 
-			fs_block indirectBlock;
-			/* Allocating certain free block as an indirect block, and blocking from the bitmap */		
-			disk->read(indirectBlockIndex, indirectBlock.data);
+	/* Served from the inode cache: no disk access once the inode block was loaded */
+	fs_inode inode;
+	load_inode(inumber, inode);
+	if (inode.isvalid)
+	{
+		return inode.size;
+	}
+	return -1;
+}
 
-			set_bitmap_bit_by_index(1, indirectBlockIndex);
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::fs_read(int inumber, char *data, int length, long long offset)
+{
+	std::shared_lock<std::shared_mutex> mountGuard(mountLock);
 
-			/* Iterates over indirect blocks */
-			for (int i = 0; i < POINTERS_PER_BLOCK; ++i)
-			{
-				if (writtenBytes == length)
-				{
-					break;
-				}
-				if (indirectBlock.pointers[i] == 0)
-				{
-					int freeBlockIndex = find_first_free_block();
-					if (freeBlockIndex == -1)
-					{
-						cout << "DISK FULL!!!!" << endl;
-						break;
-					}
-					erase_indirect_block(freeBlockIndex);
+	if (!isMounted)
+	{
+		cout << "File System is not yet mounted!";
+		return 0;
+	}
 
-					/* Setting allocated block to pointer of indirect block */
-					indirectBlock.pointers[i] = freeBlockIndex;
+	if (inumber > superblock.ninodes || inumber <= 0)
+	{
+		cout << "Inumber is invalid. (bigger than the amount of inodes or equals to 0.)" << endl;
+		return 0;
+	}
 
-					union fs_block indirectPointedBlock;
+	/* Other readers of the file go on at the same time, writers wait */
+	std::shared_lock<std::shared_mutex> inodeGuard(inode_lock(inumber));
 
-					set_bitmap_bit_by_index(1, freeBlockIndex);
-					int bytesToCopy = min(length - writtenBytes, Disk::DISK_BLOCK_SIZE - 0);
+	/* Gets the exact inode requested by the inumber from the inode cache */
+	fs_inode inode;
+	load_inode(inumber, inode);
 
-					/* Copies data from the output buffer to the block */
-					memcpy(indirectPointedBlock.data, data + writtenBytes, bytesToCopy);
+	if (!inode.isvalid)
+	{
+		cout << "Inode is invalid." << endl;
+		return 0;
+	}
 
-					/* Updating block with new written data in disk */
-					disk->write(freeBlockIndex, indirectPointedBlock.data);
+	if (offset < 0)
+	{
+		cout << "Offset is invalid (negative)." << endl;
+		return 0;
+	}
 
-					/*  Update counters */
-					writtenBytes += bytesToCopy;
-				}
-			}
-			/* Updating indirect block with new pointers */
-			disk->write(indirectBlockIndex, indirectBlock.data);
-		}
+	if (offset > inode.size)
+	{
+		cout << "Offset is invalid (bigger than inode size)." << endl;
+		return 0;
 	}
 
-	/* We only override the inode size on the first iteration, that is, when offset equals to 0.*/
-	if (offset == 0)
+	/*
+	* Offset + length cannot be bigger then inode size.
+	* If that's the case, we adjust length to include everything until the end
+	* of the inode data.
+	*/
+
+	if (offset + length > inode.size)
 	{
-		inode.size = writtenBytes;
-	} else {
-		inode.size += writtenBytes;
+		length = (int)(inode.size - offset);
 	}
-	
-	blockWithInode.inode[inodeIndexInBlock] = inode;
-	disk->write(blockWithInodeIndex, blockWithInode.data);
 
-	return writtenBytes;
-}
+	/* Total read bytes */
+	int readBytes = 0;
+	if (length <= 0)
+	{
+		return 0;
+	}
 
-void INE5412_FS::instantiate_bitmap()
-{
-	/* Always setting the first bit as 1 for the superblock. 
-	This can be done without any checks because this function is only called 
-	where the presence and validity of superblock is already checked */
-	union fs_block superblock;
-	disk->read(0, superblock.data);
+	/* An inline file came with its inode, there is nothing else to read */
+	if (is_inline_inode(inode))
+	{
+		memcpy(data, inode.inline_data() + offset, length);
+		return length;
+	}
 
-	/* Setting bitmap as a vector of 0`s */
-	bitmap =  std::vector<bool>(superblock.super.nblocks, 0);
+	/* Calculates the first and last blocks for data; file blocks are ints, sizes and offsets aren't */
+	int startBlock = (int)(offset / BLOCK_SIZE);
+	int endBlock = (int)((offset + length - 1) / BLOCK_SIZE);
+	/* Calculates the starting offset within the first block */
+	int startOffset = (int)(offset % BLOCK_SIZE);
 
-	/* Setting the superblock as 1 (index 0)*/
-	set_bitmap_bit_by_index(1, 0);
+	/* Sequential reads bring the next blocks of the file into the cache ahead of time */
+	readahead(inumber, inode, offset, length);
 
-	int numberOfInodeBlocks = superblock.super.ninodeblocks;
+	/* Collects the pointers to every data block in the range */
+	std::vector<int> pointedBlocks;
+	collect_data_pointers(inode, startBlock, endBlock, pointedBlocks);
 
-	/* Setting 1's for inode blocks */
-	for (int i = 0; i < numberOfInodeBlocks; i++)
+	if (disk->is_mapped())
 	{
-		union fs_block inodeBlock;
-		disk->read(i + 1, inodeBlock.data);
-		for (int j = 0; j < INODES_PER_BLOCK; j++)
+		/* The image is mapped in memory, so the data is copied straight from the mapping */
+		for (size_t i = 0; i < pointedBlocks.size(); ++i)
 		{
-			if (inodeBlock.inode[j].isvalid) {
-				/* If at least one inode in the inode block is valid, then the block is in use */
-				set_bitmap_bit_by_index(1, i + 1);
-				break;
+			int bytesToCopy = min(length - readBytes, BLOCK_SIZE - startOffset);
+			if (pointedBlocks[i] == 0)
+			{
+				memset(data + readBytes, 0, bytesToCopy);
+			}
+			else
+			{
+				memcpy(data + readBytes, disk->block_pointer(pointedBlocks[i]) + startOffset, bytesToCopy);
 			}
+			readBytes += bytesToCopy;
+			startOffset = 0;
 		}
+		return readBytes;
 	}
-}
 
-void INE5412_FS::set_bitmap_bit_by_index(bool bit, int index)
-{
-	bitmap.at(index) = bit;
+	/*
+	* Blocks fully covered by the request are read straight into the caller's buffer.
+	* Only a partial first or last block goes through a bounce buffer.
+	* A zero pointer is a hole, which reads back as zeros with no disk access.
+	*/
+	union fs_block headBlock;
+	union fs_block tailBlock;
+	std::vector<int> blocksToRead;
+	std::vector<char *> buffers;
+	int headBytes = 0;
+	int tailBytes = 0;
+
+	for (size_t i = 0; i < pointedBlocks.size(); ++i)
+	{
+		int inBlockOffset = (i == 0) ? startOffset : 0;
+		int bytesToCopy = min(length - readBytes, BLOCK_SIZE - inBlockOffset);
+
+		if (pointedBlocks[i] == 0)
+		{
+			memset(data + readBytes, 0, bytesToCopy);
+		}
+		else if (bytesToCopy == BLOCK_SIZE)
+		{
+			blocksToRead.push_back(pointedBlocks[i]);
+			buffers.push_back(data + readBytes);
+		}
+		else
+		{
+			blocksToRead.push_back(pointedBlocks[i]);
+			buffers.push_back(i == 0 ? headBlock.data : tailBlock.data);
+			(i == 0 ? headBytes : tailBytes) = bytesToCopy;
+		}
+		readBytes += bytesToCopy;
+	}
+
+	/* Reads all of them at once, so adjacent pointers become a single request to the disk */
+	disk->read_blocks(blocksToRead, buffers);
+
+	/* Copies the partial blocks from their bounce buffers */
+	if (headBytes > 0)
+	{
+		memcpy(data, headBlock.data + startOffset, headBytes);
+	}
+	if (tailBytes > 0)
+	{
+		memcpy(data + readBytes - tailBytes, tailBlock.data, tailBytes);
+	}
+
+	return readBytes;
 }
 
-int INE5412_FS::find_first_free_block()
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::fs_write(int inumber, const char *data, int length, long long offset)
 {
-	union fs_block superblock;
-	/* Reads and stores superblock to block variable */
-	disk->read(0, superblock.data);
+	std::shared_lock<std::shared_mutex> mountGuard(mountLock);
 
-	/* The start index will be the number of inode blocks + 1 (superblock) */
-	int startIndex = superblock.super.ninodeblocks + 1;
+	if (!isMounted) {
+		cout << "File System is not yet mounted!";
+		return 0;
+	}
 
-	int pos = -1;
-	for (int i = startIndex; i < bitmap.size(); i++)
-	{
-		if (bitmap.at(i) == 0)
-		{
-			pos = i;
-			break;
-		}
+	if (inumber > superblock.ninodes || inumber <= 0) {
+		cout << "Inumber is invalid. (bigger than the amount of inodes or equals to 0.)" << endl;
+		return 0;
 	}
 
-	if (pos == -1)
+	/*
+	* Blocks freed by the running transaction can't be reused before it commits. When the write
+	* needs them, write_file gives up before changing anything, and starts over once it's committed.
+	*/
+	int written;
+	while ((written = write_file(inumber, data, length, offset)) == -1)
 	{
-		cout << "ERROR! There are no free blocks!" << endl;
+		journal_wait_commit();
 	}
-	return pos;
+	return written;
 }
 
-void INE5412_FS::erase_entire_inode(int inumber)
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::write_file(int inumber, const char *data, int length, long long offset)
 {
-	int blockWithInodeIndex = 1 + inumber / INODES_PER_BLOCK;
-	/* Adding one to the modulo since inumbers always start in 1 */
-	int inodeIndexInBlock = (inumber - 1) % INODES_PER_BLOCK;
+	/* fs_write once the file system and the inumber are checked. Returns -1 to be called again after a commit */
+	fs_operation operation(this);
+	std::unique_lock<std::shared_mutex> inodeGuard(inode_lock(inumber));
 
-	/* Reads the block and stores in block.data */
-	union fs_block blockWithInode;
-	disk->read(blockWithInodeIndex, blockWithInode.data);
+	/* Gets the exact inode requested by the inumber from the inode cache */
+	fs_inode inode;
+	load_inode(inumber, inode);
 
-	/* Gets the exact inode requested by the inumber */
-	fs_inode inode = blockWithInode.inode[inodeIndexInBlock];
+	if (!inode.isvalid) {
+		cout << "Inode is invalid. Aborting write..." << endl;
+		return 0;
+	}
 
-	for (int k = 0; k < POINTERS_PER_INODE; k++)
+	/* The write may start past the end of the file, which leaves a hole up to the offset */
+	if (offset < 0)
 	{
-		if (inode.direct[k] != 0)
-		{
-			set_bitmap_bit_by_index(0, inode.direct[k]);
-			inode.direct[k] = 0;
-		}
+		cout << "Offset is invalid (negative)." << endl;
+		return 0;
 	}
 
-	if (inode.indirect != 0)
+	long long maxFileSize = max_file_size();
+	if (length > maxFileSize - offset)
+	{
+		length = (int)max(maxFileSize - offset, 0LL);
+	}
+	if (length <= 0)
 	{
-		int indirectBlockIndex = inode.indirect;
-		union fs_block indirectBlock;
-		disk->read(indirectBlockIndex, indirectBlock.data);
+		return 0;
+	}
 
-		/* Iterates over indirect blocks and set them to zero */
-		for (int k = 0; k < POINTERS_PER_BLOCK; k++)
+	/* An inline file stays in the inode while it fits; the bytes of a hole in it are already zero */
+	if (is_inline_inode(inode))
+	{
+		if (offset + length <= INLINE_DATA_SIZE)
 		{
-			if (indirectBlock.pointers[k] != 0)
-			{
-				set_bitmap_bit_by_index(0, indirectBlock.pointers[k]);
-				indirectBlock.pointers[k] = 0;
-			}
+			memcpy(inode.inline_data() + offset, data, length);
+			inode.size = max(inode.size, offset + length);
+			store_inode(inumber, inode);
+			return length;
+		}
+		int moved = move_inline_data(inumber, inode);
+		if (moved != 1)
+		{
+			return moved;
 		}
-		set_bitmap_bit_by_index(0, inode.indirect);
-		inode.indirect = 0;
 	}
+
+	return write_range(inumber, inode, data, length, offset);
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::move_inline_data(int inumber, fs_inode &inode)
+{
+	/* The data becomes block 0 of the file, which from then on maps its blocks like any other.
+	The inode is only stored once that block is written, so a full disk leaves it inline.
+	Returns 1 when it moved, 0 when the disk is full and -1 like write_range */
+	char inlineData[INLINE_DATA_SIZE];
+	memcpy(inlineData, inode.inline_data(), INLINE_DATA_SIZE);
+	int size = (int)inode.size;
+
+	inode.isvalid &= ~INODE_INLINE;
+	memset(inode.inline_data(), 0, INLINE_DATA_SIZE);
 	inode.size = 0;
+	if (size == 0)
+	{
+		return 1;
+	}
+
+	int written = write_range(inumber, inode, inlineData, size, 0);
+	if (written == -1)
+	{
+		return -1;
+	}
+	if (written != size)
+	{
+		cout << "DISK FULL!!!!" << endl;
+		return 0;
+	}
+	return 1;
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::write_range(int inumber, fs_inode &inode, const char *data, int length, long long offset)
+{
+	/*
+	* Writes happen in place: blocks that already exist are reused and only the missing ones
+	* are allocated, so it's an overwrite, an append or both. Blocks of a hole before the offset
+	* stay unallocated. Shrinking a file is up to fs_truncate.
+	* Returns -1, with nothing changed, when it would need blocks that only the commit of the
+	* running transaction frees.
+	*/
+	int startBlock = (int)(offset / BLOCK_SIZE);
+	int endBlock = (int)((offset + length - 1) / BLOCK_SIZE);
 
-	blockWithInode.inode[inodeIndexInBlock] = inode;
-	disk->write(blockWithInodeIndex, blockWithInode.data);
+	/* Pointers of the range; the ones that are still zero are the blocks that must be allocated */
+	std::vector<int> pointedBlocks;
+	collect_data_pointers(inode, startBlock, endBlock, pointedBlocks);
+	pointedBlocks.resize(endBlock - startBlock + 1, 0);
+
+	int missingBlocks = 0;
+	for (size_t i = 0; i < pointedBlocks.size(); ++i)
+	{
+		if (pointedBlocks[i] == 0)
+		{
+			missingBlocks++;
+		}
+	}
+	/*
+	* Reserves every missing data block at once, so they come out of the bitmap as a contiguous run
+	* whenever there is one. Indirect blocks are allocated by map_block as the range reaches them,
+	* right after the run, keeping the data of the file sequential on disk.
+	*/
+	if (needs_pending_free(missingBlocks))
+	{
+		return -1;
+	}
+	std::deque<int> reservedBlocks;
+	allocate_blocks(missingBlocks, reservedBlocks);
+
+	fs_block_map map(inode);
+	std::vector<bool> isNewBlock(pointedBlocks.size(), false);
+	int lastMappedBlock = startBlock - 1;
+
+	for (size_t i = 0; i < pointedBlocks.size(); ++i)
+	{
+		int fileBlock = startBlock + i;
+
+		if (pointedBlocks[i] == 0)
+		{
+			int freeBlockIndex = map_block(map, fileBlock, &reservedBlocks);
+			if (freeBlockIndex <= 0)
+			{
+				break;
+			}
+			pointedBlocks[i] = freeBlockIndex;
+			isNewBlock[i] = true;
+		}
+		lastMappedBlock = fileBlock;
+	}
+
+	/* Gives back whatever was reserved but not used */
+	release_blocks(reservedBlocks);
+
+	if (lastMappedBlock < endBlock)
+	{
+		cout << "DISK FULL!!!!" << endl;
+		pointedBlocks.resize(lastMappedBlock - startBlock + 1);
+		length = (int)min((long long)length, (long long)(lastMappedBlock + 1) * BLOCK_SIZE - offset);
+	}
+
+	/*
+	* Data blocks are written all at once, so adjacent ones become a single request.
+	* Full blocks are written straight from the caller's buffer. A partial first or last block
+	* is a read-modify-write when the block already existed, and zero-filled in memory when it's new.
+	*/
+	union fs_block headBlock;
+	union fs_block tailBlock;
+	std::vector<const char *> buffers;
+	int writtenBytes = 0;
+
+	for (size_t i = 0; i < pointedBlocks.size(); ++i)
+	{
+		int inBlockOffset = (i == 0) ? (int)(offset % BLOCK_SIZE) : 0;
+		int bytesToCopy = min(length - writtenBytes, BLOCK_SIZE - inBlockOffset);
+
+		if (bytesToCopy == BLOCK_SIZE)
+		{
+			buffers.push_back(data + writtenBytes);
+		}
+		else
+		{
+			union fs_block &bounceBlock = (i == 0) ? headBlock : tailBlock;
+			if (isNewBlock[i])
+			{
+				memset(bounceBlock.data, 0, BLOCK_SIZE);
+			}
+			else
+			{
+				disk->read(pointedBlocks[i], bounceBlock.data);
+			}
+			memcpy(bounceBlock.data + inBlockOffset, data + writtenBytes, bytesToCopy);
+			buffers.push_back(bounceBlock.data);
+		}
+		writtenBytes += bytesToCopy;
+	}
+	disk->write_blocks(pointedBlocks, buffers);
+
+	/* Updating indirect blocks with new pointers */
+	flush_block_map(map);
+
+	/* The size only grows when the write goes past the current end of the file, and wrote something there */
+	bool inodeChanged = map.inodeChanged;
+	if (writtenBytes > 0 && offset + writtenBytes > inode.size)
+	{
+		inode.size = offset + writtenBytes;
+		inodeChanged = true;
+	}
+
+	/* An overwrite that didn't allocate anything leaves the inode block untouched */
+	if (inodeChanged)
+	{
+		store_inode(inumber, inode);
+	}
+
+	return writtenBytes;
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::fs_truncate(int inumber, long long size)
+{
+	std::shared_lock<std::shared_mutex> mountGuard(mountLock);
+
+	if (!isMounted) {
+		cout << "File System is not yet mounted!";
+		return 0;
+	}
+
+	if (inumber > superblock.ninodes || inumber <= 0) {
+		cout << "Inumber is invalid. (bigger than the amount of inodes or equals to 0.)" << endl;
+		return 0;
+	}
+
+	/* Only growing an inline file past the inode allocates, and may have to wait for a commit like fs_write */
+	int result;
+	while ((result = truncate_file(inumber, size)) == -1)
+	{
+		journal_wait_commit();
+	}
+	return result;
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::truncate_file(int inumber, long long size)
+{
+	fs_operation operation(this);
+	std::unique_lock<std::shared_mutex> inodeGuard(inode_lock(inumber));
+
+	fs_inode inode;
+	load_inode(inumber, inode);
+
+	if (!inode.isvalid) {
+		cout << "Inode is invalid." << endl;
+		return 0;
+	}
+
+	if (size < 0 || size > max_file_size()) {
+		cout << "Size is invalid." << endl;
+		return 0;
+	}
+
+	/* Growing leaves a hole at the end, which takes no blocks. An inline file leaves the inode if it no longer fits */
+	if (size > inode.size)
+	{
+		if (is_inline_inode(inode) && size > INLINE_DATA_SIZE)
+		{
+			int moved = move_inline_data(inumber, inode);
+			if (moved != 1)
+			{
+				return moved;
+			}
+		}
+		inode.size = size;
+		store_inode(inumber, inode);
+		return 1;
+	}
+
+	/* Zeroes what was cut from an inline file, so growing it again never exposes old data */
+	if (is_inline_inode(inode))
+	{
+		memset(inode.inline_data() + size, 0, INLINE_DATA_SIZE - size);
+		inode.size = size;
+		store_inode(inumber, inode);
+		return 1;
+	}
+
+	/* A file that fits in the inode again goes back into it, and all its blocks are freed */
+	if ((superblock.flags & FS_INLINE) && size <= INLINE_DATA_SIZE)
+	{
+		union fs_block block;
+		memset(block.data, 0, BLOCK_SIZE);
+		std::vector<int> firstBlock;
+		if (size > 0)
+		{
+			collect_data_pointers(inode, 0, 0, firstBlock);
+		}
+		if (!firstBlock.empty() && firstBlock[0] > 0)
+		{
+			disk->read(firstBlock[0], block.data);
+		}
+
+		release_inode_blocks(inode, 0);
+		inode.isvalid |= INODE_INLINE;
+		memset(inode.inline_data(), 0, INLINE_DATA_SIZE);
+		memcpy(inode.inline_data(), block.data, size);
+		inode.size = size;
+		store_inode(inumber, inode);
+		return 1;
+	}
+
+	/* Every block that is entirely past the new size goes back to the bitmap */
+	int firstFreedBlock = size_blocks(size);
+	release_inode_blocks(inode, firstFreedBlock);
+
+	/* Zeroes the rest of the new last block, so growing the file again never exposes old data */
+	int lastBytes = (int)(size % BLOCK_SIZE);
+	if (lastBytes != 0)
+	{
+		int lastFileBlock = (int)(size / BLOCK_SIZE);
+		std::vector<int> lastBlock;
+		collect_data_pointers(inode, lastFileBlock, lastFileBlock, lastBlock);
+		if (!lastBlock.empty() && lastBlock[0] != 0)
+		{
+			union fs_block block;
+			disk->read(lastBlock[0], block.data);
+			memset(block.data + lastBytes, 0, BLOCK_SIZE - lastBytes);
+			disk->write(lastBlock[0], block.data);
+		}
+	}
+
+	inode.size = size;
+	store_inode(inumber, inode);
+
+	return 1;
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::fs_fsck()
+{
+	/* Same scan as a mount that has to rebuild the bitmaps, reporting what's wrong instead of skipping it.
+	Nothing else runs meanwhile, so the bitmaps in use can be compared with what was found */
+	std::unique_lock<std::shared_mutex> mountGuard(mountLock);
+
+	if (isMounted)
+	{
+		/* Committing also applies the pending frees, which are already free for the scan */
+		std::lock_guard<std::mutex> journalGuard(journalLock);
+		journal_commit();
+	}
+	else
+	{
+		union fs_block block;
+		disk->read(0, block.data);
+		if (!load_superblock(block.super))
+		{
+			cout << "The disk is invalid!";
+			return -1;
+		}
+	}
+
+	std::vector<fs_scan_worker> workers(scan_workers());
+	std::vector<std::string> problems;
+
+	auto start = std::chrono::steady_clock::now();
+	scan_inode_table(workers, true);
+	double inodeTableMs = elapsed_ms(start);
+
+	start = std::chrono::steady_clock::now();
+	scan_indirect_blocks(workers, true);
+	double indirectMs = elapsed_ms(start);
+
+	start = std::chrono::steady_clock::now();
+	Bitmap blocks(superblock.nblocks);
+	Bitmap inodes(superblock.ninodes);
+	for (int i = 0; i < firstDataBlock; i++)
+	{
+		blocks.set(i);
+	}
+	merge_scan(workers, blocks, inodes, &problems);
+	double mergeMs = elapsed_ms(start);
+
+	/* The bitmaps in use (or the ones on disk, after a clean unmount) must match what was found */
+	start = std::chrono::steady_clock::now();
+	bool compareBitmaps = isMounted || (has_bitmap_region() && (superblock.flags & FS_CLEAN));
+	if (compareBitmaps)
+	{
+		if (!isMounted)
+		{
+			load_bitmaps();
+		}
+		/* Word by word, since a large disk has billions of bits and hardly any of them differ */
+		for (int i = bitmap.find_difference(blocks, firstDataBlock); i != -1; i = bitmap.find_difference(blocks, i + 1))
+		{
+			if (bitmap.get(i))
+			{
+				problems.push_back("block " + std::to_string(i) + " is marked in use but not referenced");
+			}
+			else
+			{
+				problems.push_back("block " + std::to_string(i) + " is referenced but marked free");
+			}
+		}
+		for (int i = inodeBitmap.find_difference(inodes, 0); i != -1; i = inodeBitmap.find_difference(inodes, i + 1))
+		{
+			problems.push_back("inode " + std::to_string(i + 1) + " is marked " + (inodeBitmap.get(i) ? "valid" : "free") + " in the inode bitmap");
+		}
+	}
+	double bitmapMs = elapsed_ms(start);
+
+	for (size_t i = 0; i < problems.size(); i++)
+	{
+		cout << problems[i] << endl;
+	}
+
+	cout << "fsck with " << workers.size() << " worker(s):" << endl;
+	cout << "    inode table: " << inodeTableMs << " ms" << endl;
+	cout << "    indirect blocks: " << indirectMs << " ms" << endl;
+	cout << "    merge: " << mergeMs << " ms" << endl;
+	if (compareBitmaps)
+	{
+		cout << "    bitmaps: " << bitmapMs << " ms" << endl;
+	}
+	cout << "    " << blocks.count_set() - firstDataBlock << " data blocks in use, " << inodes.count_set() << " valid inodes" << endl;
+
+	return problems.size();
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::fs_sync()
+{
+	/* Waits for the operations in progress, so the running transaction can commit */
+	std::unique_lock<std::shared_mutex> mountGuard(mountLock);
+
+	if (isMounted)
+	{
+		std::lock_guard<std::mutex> journalGuard(journalLock);
+		journal_commit();
+	}
+	disk->sync();
+	return 1;
+}
+
+template <int BLOCK_SIZE>
+bool INE5412_FS::fs_impl<BLOCK_SIZE>::load_superblock(const fs_superblock &super)
+{
+	/* Validates the geometry before trusting it for the rest of the session */
+	if (super.magic != FS_MAGIC)
+	{
+		return false;
+	}
+
+	if (super.nblocks <= 0 || super.nblocks > disk->size())
+	{
+		cout << "Superblock has an invalid number of blocks (" << super.nblocks << ")." << endl;
+		return false;
+	}
+
+	/* Nothing else in the image can be read with another block size */
+	if (image_block_size(super) != BLOCK_SIZE)
+	{
+		cout << "Image has " << image_block_size(super) << "-byte blocks, not " << BLOCK_SIZE << "-byte ones." << endl;
+		return false;
+	}
+
+	int perBlock = LEGACY_INODES_PER_BLOCK;
+	int recordSize = sizeof(fs_legacy_inode);
+	bool wide = super.version >= FS_VERSION_LARGE_FILES && super.version <= FS_VERSION;
+	if (super.version >= FS_VERSION_INLINE && super.version <= FS_VERSION && (super.flags & FS_INLINE))
+	{
+		perBlock = wide ? INLINE_INODES_PER_BLOCK : NARROW_INLINE_INODES_PER_BLOCK;
+		recordSize = wide ? INLINE_INODE_SIZE : NARROW_INLINE_INODE_SIZE;
+	}
+	else if (super.version >= FS_VERSION_INDIRECT && super.version <= FS_VERSION)
+	{
+		perBlock = wide ? INODES_PER_BLOCK : NARROW_INODES_PER_BLOCK;
+		recordSize = wide ? INODE_SIZE : NARROW_INODE_SIZE;
+	}
+	if (super.ninodeblocks <= 0 || super.ninodeblocks >= super.nblocks ||
+		(long long)super.ninodes != (long long)super.ninodeblocks * perBlock)
+	{
+		cout << "Superblock has an invalid inode table geometry." << endl;
+		return false;
+	}
+
+	superblock = super;
+	inodesPerBlock = perBlock;
+	inodeSize = recordSize;
+	if (superblock.version >= FS_VERSION_BITMAPS && superblock.version <= FS_VERSION)
+	{
+		int bitsPerBlock = BLOCK_SIZE * 8;
+		if (superblock.bitmapstart != superblock.ninodeblocks + 1 ||
+			superblock.nbitmapblocks != (superblock.nblocks + bitsPerBlock - 1) / bitsPerBlock ||
+			superblock.ninodebitmapblocks != ((long long)superblock.ninodes + bitsPerBlock - 1) / bitsPerBlock)
+		{
+			cout << "Superblock has an invalid bitmap region." << endl;
+			return false;
+		}
+		firstDataBlock = superblock.bitmapstart + superblock.nbitmapblocks + superblock.ninodebitmapblocks;
+
+		if (superblock.version < FS_VERSION_EXTENTS)
+		{
+			superblock.flags &= ~FS_EXTENTS;
+		}
+		if (superblock.version < FS_VERSION_INLINE)
+		{
+			superblock.flags &= ~FS_INLINE;
+		}
+		if (superblock.version < FS_VERSION_LAZY_INIT)
+		{
+			superblock.ninitinodeblocks = superblock.ninodeblocks;
+		}
+		else if (superblock.ninitinodeblocks < 0 || superblock.ninitinodeblocks > superblock.ninodeblocks)
+		{
+			cout << "Superblock has an invalid number of initialized inode blocks." << endl;
+			return false;
+		}
+
+		if (superblock.version < FS_VERSION_JOURNAL)
+		{
+			superblock.journalstart = 0;
+			superblock.njournalblocks = 0;
+		}
+		else
+		{
+			/* At least the descriptor, one block and the commit record */
+			if (superblock.journalstart != firstDataBlock ||
+				(superblock.njournalblocks != 0 && (superblock.njournalblocks < 3 || superblock.njournalblocks > JOURNAL_MAX_BLOCKS)))
+			{
+				cout << "Superblock has an invalid journal region." << endl;
+				return false;
+			}
+			firstDataBlock += superblock.njournalblocks;
+		}
+	}
+	else
+	{
+		/* Images from before the bitmap region: whatever follows the first 16 bytes is ignored */
+		superblock.version = 0;
+		superblock.flags = 0;
+		superblock.bitmapstart = 0;
+		superblock.nbitmapblocks = 0;
+		superblock.ninodebitmapblocks = 0;
+		superblock.journalstart = 0;
+		superblock.njournalblocks = 0;
+		superblock.ninitinodeblocks = superblock.ninodeblocks;
+		firstDataBlock = superblock.ninodeblocks + 1;
+	}
+	initializedInodeBlocks = superblock.ninitinodeblocks;
+
+	if (firstDataBlock >= superblock.nblocks)
+	{
+		return false;
+	}
+	return true;
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::write_superblock()
+{
+	union fs_block block;
+	memset(block.data, 0, BLOCK_SIZE);
+	block.super = superblock;
+	disk->write(0, block.data);
+}
+
+template <int BLOCK_SIZE>
+bool INE5412_FS::fs_impl<BLOCK_SIZE>::has_bitmap_region()
+{
+	return superblock.version >= FS_VERSION_BITMAPS;
+}
+
+template <int BLOCK_SIZE>
+bool INE5412_FS::fs_impl<BLOCK_SIZE>::has_journal()
+{
+	return superblock.njournalblocks > 0;
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::journal_capacity()
+{
+	/* The descriptor lists every block number after its header */
+	int listed = POINTERS_PER_BLOCK - sizeof(fs_journal_header) / sizeof(int);
+	return min(superblock.njournalblocks - 2, listed);
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::journal_begin()
+{
+	if (!has_journal())
+	{
+		return;
+	}
+
+	/* A full transaction, or one an operation waits for, must commit before anything else joins it */
+	std::unique_lock<std::mutex> journalGuard(journalLock);
+	journalIdle.wait(journalGuard, [this] {
+		return !commitRequested && (int)journalBlocks.size() < journal_capacity() / 2;
+	});
+	journalOperations++;
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::journal_end()
+{
+	if (!has_journal())
+	{
+		return;
+	}
+
+	/* Group commit: the last operation to leave a transaction that is half the journal commits it */
+	std::unique_lock<std::mutex> journalGuard(journalLock);
+	journalOperations--;
+	if (journalOperations == 0 && (commitRequested || (int)journalBlocks.size() >= journal_capacity() / 2))
+	{
+		journal_commit();
+	}
+	journalIdle.notify_all();
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::journal_wait_commit()
+{
+	/*
+	* Commits the running transaction as soon as the operations in progress leave it, which frees
+	* the blocks waiting in pendingFree. Called outside of any operation and without inode locks,
+	* since the operations it waits for may need them.
+	*/
+	std::unique_lock<std::mutex> journalGuard(journalLock);
+	commitRequested = true;
+	if (journalOperations == 0)
+	{
+		journal_commit();
+		journalIdle.notify_all();
+		return;
+	}
+	journalIdle.wait(journalGuard, [this] { return !commitRequested; });
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::journal_commit()
+{
+	/* Callers hold journalLock with no operation in progress, or have the file system to themselves */
+	if (!has_journal())
+	{
+		return;
+	}
+	commitRequested = false;
+
+	{
+		std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+		for (size_t i = 0; i < pendingFree.size(); i++)
+		{
+			set_bitmap_bit_by_index(0, pendingFree[i]);
+		}
+		pendingFree.clear();
+
+		/* The bitmaps are copied now, when they only have the changes of finished operations */
+		for (std::set<int>::iterator it = dirtyBitmapBlocks.begin(); it != dirtyBitmapBlocks.end(); ++it)
+		{
+			int index = *it - superblock.bitmapstart;
+			if (index < superblock.nbitmapblocks)
+			{
+				bitmap.save_range(journalBlocks[*it].data, index * BLOCK_SIZE, BLOCK_SIZE);
+			}
+			else
+			{
+				index -= superblock.nbitmapblocks;
+				inodeBitmap.save_range(journalBlocks[*it].data, index * BLOCK_SIZE, BLOCK_SIZE);
+			}
+		}
+		dirtyBitmapBlocks.clear();
+	}
+
+	if (journalBlocks.empty())
+	{
+		return;
+	}
+
+	std::vector<int> blocknums;
+	std::vector<const char *> buffers;
+	for (typename std::map<int, fs_block>::iterator it = journalBlocks.begin(); it != journalBlocks.end(); ++it)
+	{
+		blocknums.push_back(it->first);
+		buffers.push_back(it->second.data);
+	}
+	int count = blocknums.size();
+
+	if (count > journal_capacity())
+	{
+		/* Doesn't fit in the journal: written in place, with the file system marked as not clean
+		until it's unmounted, so a crash means a full scan instead of a replay */
+		journal_clear();
+		superblock.flags &= ~FS_CLEAN;
+		write_superblock();
+		disk->sync();
+		disk->write_blocks(blocknums, buffers);
+	}
+	else
+	{
+		/* Ordered: the data written by these operations, and the previous checkpoint, are on disk first */
+		disk->sync();
+
+		/* Descriptor, blocks and commit record go out as a single contiguous write */
+		std::vector<fs_block> record(count + 2);
+		memset(record[0].data, 0, BLOCK_SIZE);
+		record[0].journal.magic = JOURNAL_MAGIC;
+		record[0].journal.sequence = journalSequence;
+		record[0].journal.count = count;
+		record[0].journal.checksum = 0;
+		int *listed = record[0].pointers + sizeof(fs_journal_header) / sizeof(int);
+		for (int i = 0; i < count; i++)
+		{
+			listed[i] = blocknums[i];
+			memcpy(record[i + 1].data, buffers[i], BLOCK_SIZE);
+		}
+
+		memset(record[count + 1].data, 0, BLOCK_SIZE);
+		record[count + 1].journal.magic = JOURNAL_COMMIT_MAGIC;
+		record[count + 1].journal.sequence = journalSequence;
+		record[count + 1].journal.count = count;
+		record[count + 1].journal.checksum = journal_checksum(record, count + 1);
+
+		/* A single sync: a torn record fails the checksum and is never replayed */
+		disk->write_blocks(superblock.journalstart, count + 2, record[0].data);
+		disk->sync();
+
+		/* Checkpoint; the next commit's first sync makes it durable before the journal is written again */
+		disk->write_blocks(blocknums, buffers);
+	}
+
+	journalBlocks.clear();
+	journalSequence++;
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::journal_replay()
+{
+	std::vector<fs_block> record(1);
+	disk->read(superblock.journalstart, record[0].data);
+	fs_journal_header header = record[0].journal;
+	if (header.magic != JOURNAL_MAGIC)
+	{
+		/* Empty: cleared on unmount, or after the last replay */
+		return;
+	}
+	journalSequence = header.sequence + 1;
+
+	bool valid = header.count > 0 && header.count <= journal_capacity();
+	if (valid)
+	{
+		record.resize(header.count + 2);
+		disk->read_blocks(superblock.journalstart + 1, header.count + 1, record[1].data);
+
+		fs_journal_header commit = record[header.count + 1].journal;
+		valid = commit.magic == JOURNAL_COMMIT_MAGIC && commit.sequence == header.sequence &&
+				commit.count == header.count && commit.checksum == journal_checksum(record, header.count + 1);
+	}
+
+	/* Only metadata is ever logged, never the superblock or the journal itself */
+	std::vector<int> blocknums;
+	std::vector<const char *> buffers;
+	int *listed = record[0].pointers + sizeof(fs_journal_header) / sizeof(int);
+	for (int i = 0; valid && i < header.count; i++)
+	{
+		bool inJournal = listed[i] >= superblock.journalstart && listed[i] < superblock.journalstart + superblock.njournalblocks;
+		valid = listed[i] > 0 && listed[i] < superblock.nblocks && !inJournal;
+		blocknums.push_back(listed[i]);
+		buffers.push_back(record[i + 1].data);
+	}
+
+	if (valid)
+	{
+		cout << "Replaying journal transaction " << header.sequence << " (" << header.count << " blocks)." << endl;
+		disk->write_blocks(blocknums, buffers);
+		disk->sync();
+	}
+	else
+	{
+		/* The crash happened while it was being written, so the operations in it never happened */
+		cout << "Discarding incomplete journal transaction " << header.sequence << "." << endl;
+	}
+
+	journal_clear();
+	disk->sync();
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::journal_clear()
+{
+	union fs_block block;
+	memset(block.data, 0, BLOCK_SIZE);
+	disk->write(superblock.journalstart, block.data);
+}
+
+template <int BLOCK_SIZE>
+unsigned int INE5412_FS::fs_impl<BLOCK_SIZE>::journal_checksum(const std::vector<fs_block> &blocks, int count)
+{
+	/* FNV-1a over 32-bit words */
+	unsigned int hash = 2166136261u;
+	for (int i = 0; i < count; i++)
+	{
+		const unsigned int *words = (const unsigned int *)blocks[i].data;
+		for (size_t w = 0; w < BLOCK_SIZE / sizeof(unsigned int); w++)
+		{
+			hash = (hash ^ words[w]) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::read_metadata(int blocknum, char *data)
+{
+	/* The running transaction has the newest copy of a block, the disk only gets it after the commit */
+	if (has_journal())
+	{
+		std::lock_guard<std::mutex> journalGuard(journalLock);
+		typename std::map<int, fs_block>::iterator logged = journalBlocks.find(blocknum);
+		if (logged != journalBlocks.end())
+		{
+			memcpy(data, logged->second.data, BLOCK_SIZE);
+			return;
+		}
+	}
+	disk->read(blocknum, data);
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::write_metadata(int blocknum, const char *data)
+{
+	if (!has_journal())
+	{
+		disk->write(blocknum, data);
+		return;
+	}
+
+	std::lock_guard<std::mutex> journalGuard(journalLock);
+	memcpy(journalBlocks[blocknum].data, data, BLOCK_SIZE);
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::save_bitmaps()
+{
+	/* Both bitmaps are written as two contiguous runs of blocks */
+	std::vector<char> blocks((size_t)superblock.nbitmapblocks * BLOCK_SIZE, 0);
+	bitmap.save(blocks.data());
+	disk->write_blocks(superblock.bitmapstart, superblock.nbitmapblocks, blocks.data());
+
+	std::vector<char> inodeBlocks((size_t)superblock.ninodebitmapblocks * BLOCK_SIZE, 0);
+	inodeBitmap.save(inodeBlocks.data());
+	disk->write_blocks(superblock.bitmapstart + superblock.nbitmapblocks, superblock.ninodebitmapblocks, inodeBlocks.data());
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::load_bitmaps()
+{
+	std::vector<char> blocks((size_t)superblock.nbitmapblocks * BLOCK_SIZE);
+	disk->read_blocks(superblock.bitmapstart, superblock.nbitmapblocks, blocks.data());
+	bitmap.reset(superblock.nblocks);
+	bitmap.load(blocks.data());
+
+	std::vector<char> inodeBlocks((size_t)superblock.ninodebitmapblocks * BLOCK_SIZE);
+	disk->read_blocks(superblock.bitmapstart + superblock.nbitmapblocks, superblock.ninodebitmapblocks, inodeBlocks.data());
+	inodeBitmap.reset(superblock.ninodes);
+	inodeBitmap.load(inodeBlocks.data());
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::decode_inode(const fs_block &block, int index, fs_inode &inode)
+{
+	/* Records are a prefix of fs_inode, which is as large as the biggest of them; the rest stays zero */
+	memset(&inode, 0, sizeof(fs_inode));
+	if (inodesPerBlock != LEGACY_INODES_PER_BLOCK && superblock.version >= FS_VERSION_LARGE_FILES)
+	{
+		memcpy(&inode, block.data + index * inodeSize, inodeSize);
+		return;
+	}
+
+	/* Versions 4 to 8 only differ in the 32-bit size, and the fields after it start earlier */
+	if (inodesPerBlock != LEGACY_INODES_PER_BLOCK)
+	{
+		fs_narrow_inode narrow;
+		memcpy(&narrow, block.data + index * inodeSize, inodeSize);
+		inode.isvalid = narrow.isvalid;
+		inode.size = narrow.size;
+		memcpy(inode.direct, narrow.fields, inodeSize - 2 * sizeof(int));
+		return;
+	}
+
+	/* Older images have no double or triple indirect pointers, which stay zero */
+	const fs_legacy_inode &legacy = block.legacyInode[index];
+	inode.isvalid = legacy.isvalid;
+	inode.size = legacy.size;
+	memcpy(inode.direct, legacy.direct, sizeof(inode.direct));
+	inode.indirect = legacy.indirect;
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::encode_inode(fs_block &block, int index, const fs_inode &inode)
+{
+	if (inodesPerBlock != LEGACY_INODES_PER_BLOCK && superblock.version >= FS_VERSION_LARGE_FILES)
+	{
+		memcpy(block.data + index * inodeSize, &inode, inodeSize);
+		return;
+	}
+
+	/* max_file_size keeps the size of older images within 32 bits */
+	if (inodesPerBlock != LEGACY_INODES_PER_BLOCK)
+	{
+		fs_narrow_inode narrow;
+		narrow.isvalid = inode.isvalid;
+		narrow.size = (int)inode.size;
+		memcpy(narrow.fields, inode.direct, inodeSize - 2 * sizeof(int));
+		memcpy(block.data + index * inodeSize, &narrow, inodeSize);
+		return;
+	}
+
+	fs_legacy_inode &legacy = block.legacyInode[index];
+	legacy.isvalid = inode.isvalid;
+	legacy.size = (int)inode.size;
+	memcpy(legacy.direct, inode.direct, sizeof(legacy.direct));
+	legacy.indirect = inode.indirect;
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::load_inode(int inumber, fs_inode &inode)
+{
+	access_inode(inumber, inode, false);
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::store_inode(int inumber, const fs_inode &inode)
+{
+	fs_inode stored = inode;
+	access_inode(inumber, stored, true);
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::access_inode(int inumber, fs_inode &inode, bool store)
+{
+	/* Callers already checked the inumber against the superblock and hold its inode lock */
+	int blockIndex = 1 + (inumber - 1) / inodesPerBlock;
+	/* Subtracting one since inumbers always start in 1 */
+	int inodeIndexInBlock = (inumber - 1) % inodesPerBlock;
+
+	/* Never written since a lazy format: every inode there is free */
+	if (!store && blockIndex > initializedInodeBlocks)
+	{
+		memset(&inode, 0, sizeof(fs_inode));
+		return;
+	}
+
+	while (true)
+	{
+		{
+			std::shared_lock<std::shared_mutex> cacheGuard(inodeCacheLock);
+			typename std::unordered_map<int, fs_inode_block>::iterator cached = inodeCache.find(blockIndex);
+			if (cached != inodeCache.end())
+			{
+				/* The other 127 inodes of the block may be in use by other threads */
+				std::lock_guard<std::mutex> blockGuard(cached->second.lock);
+				if (!store)
+				{
+					inode = cached->second.inode[inodeIndexInBlock];
+					return;
+				}
+
+				/* Written through (into the journal, when there is one), whole and with no need to read it first,
+				so the cache never has anything dirty */
+				cached->second.inode[inodeIndexInBlock] = inode;
+				union fs_block blockWithInode;
+				memset(blockWithInode.data, 0, BLOCK_SIZE);
+				for (int i = 0; i < inodesPerBlock; i++)
+				{
+					encode_inode(blockWithInode, i, cached->second.inode[i]);
+				}
+				write_metadata(blockIndex, blockWithInode.data);
+				return;
+			}
+		}
+
+		/* First access to this inode block: the whole block is kept, not only the requested inode */
+		std::unique_lock<std::shared_mutex> cacheGuard(inodeCacheLock);
+		if (inodeCache.find(blockIndex) == inodeCache.end())
+		{
+			/* Everything cached is also on disk, so the cache can simply start over when it's full */
+			if (inodeCache.size() >= INODE_CACHE_BLOCKS)
+			{
+				inodeCache.clear();
+			}
+
+			union fs_block blockWithInode;
+			read_metadata(blockIndex, blockWithInode.data);
+			fs_inode_block &cached = inodeCache[blockIndex];
+			for (int i = 0; i < inodesPerBlock; i++)
+			{
+				decode_inode(blockWithInode, i, cached.inode[i]);
+			}
+		}
+	}
+}
+
+template <int BLOCK_SIZE>
+std::shared_mutex &INE5412_FS::fs_impl<BLOCK_SIZE>::inode_lock(int inumber)
+{
+	return inodeLocks[inumber % INODE_LOCKS];
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::inode_levels()
+{
+	/* Older images only have the single indirect pointer */
+	return superblock.version >= FS_VERSION_INDIRECT ? INDIRECT_LEVELS : 1;
+}
+
+template <int BLOCK_SIZE>
+long long INE5412_FS::fs_impl<BLOCK_SIZE>::max_file_size()
+{
+	/* File blocks are ints, so level_first_block stops at INT_MAX. Before version 9 the size is an int,
+	and with every level of indirect blocks it's the size that runs out first */
+	long long bytes = (long long)level_first_block(inode_levels() + 1) * BLOCK_SIZE;
+	if (superblock.version < FS_VERSION_LARGE_FILES)
+	{
+		return min(bytes, (long long)INT_MAX);
+	}
+	return bytes;
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::size_blocks(long long size)
+{
+	return (int)((size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::level_first_block(int level)
+{
+	/* First file block reached through the pointer with 'level' levels of indirect blocks */
+	if (level == 0)
+	{
+		return 0;
+	}
+	long long first = POINTERS_PER_INODE;
+	long long span = POINTERS_PER_BLOCK;
+	for (int l = 1; l < level; l++)
+	{
+		first += span;
+		span *= POINTERS_PER_BLOCK;
+	}
+	/* With large blocks the triple indirect pointer reaches past any int file block */
+	return (int)min(first, (long long)INT_MAX);
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::level_span(int level)
+{
+	/* File blocks under each pointer of an indirect block that is 'level' levels above the data */
+	int span = 1;
+	for (int l = 1; l < level; l++)
+	{
+		span *= POINTERS_PER_BLOCK;
+	}
+	return span;
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::block_path(int fileBlock, int offsets[INDIRECT_LEVELS + 1])
+{
+	/*
+	* Translates a file block into the pointers that lead to it. Returns the number of indirect
+	* blocks on the way, 0 for a direct pointer, or -1 when the file can't be that long.
+	* offsets[0] is the direct pointer, and offsets[d] the pointer to follow in the indirect block
+	* found at depth d - 1, starting from the inode's pointer for that many levels.
+	*/
+	if (fileBlock < 0)
+	{
+		return -1;
+	}
+	if (fileBlock < POINTERS_PER_INODE)
+	{
+		offsets[0] = fileBlock;
+		return 0;
+	}
+
+	for (int level = 1; level <= inode_levels(); level++)
+	{
+		if (fileBlock < level_first_block(level + 1))
+		{
+			int relative = fileBlock - level_first_block(level);
+			for (int d = level; d >= 1; d--)
+			{
+				offsets[d] = relative % POINTERS_PER_BLOCK;
+				relative /= POINTERS_PER_BLOCK;
+			}
+			return level;
+		}
+	}
+	return -1;
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::map_block(fs_block_map &map, int fileBlock, std::deque<int> *reserved)
+{
+	/*
+	* Returns the disk block of a file block: 0 when it has none, -1 when it can't have one.
+	* With 'reserved', a missing block is taken from its front, along with any indirect block
+	* missing on the way; it fails when there is nothing reserved left for it to point to.
+	*/
+	if (is_extent_inode(map.inode))
+	{
+		int runLength;
+		int blocknum = extent_lookup(map, fileBlock, runLength);
+		if (blocknum != 0 || reserved == nullptr)
+		{
+			return blocknum;
+		}
+		if (reserved->empty())
+		{
+			return -1;
+		}
+		blocknum = take_reserved_block(*reserved);
+		if (!extent_insert(map, fileBlock, blocknum))
+		{
+			reserved->push_front(blocknum);
+			return -1;
+		}
+		return blocknum;
+	}
+
+	int offsets[INDIRECT_LEVELS + 1];
+	int depth = block_path(fileBlock, offsets);
+	if (depth < 0)
+	{
+		return -1;
+	}
+
+	int *pointer = (depth == 0) ? &map.inode.direct[offsets[0]] : &map.inode.root(depth);
+	bool *pointerDirty = &map.inodeChanged;
+
+	for (int d = 0; d < depth; d++)
+	{
+		if (*pointer == 0)
+		{
+			/* It isn't worth taking an indirect block if there is no further free block for it to point to */
+			if (reserved == nullptr)
+			{
+				return 0;
+			}
+			std::deque<int> indirect;
+			if (reserved->empty() || allocate_blocks(1, indirect) == 0)
+			{
+				return -1;
+			}
+			*pointer = indirect.front();
+			*pointerDirty = true;
+
+			/* A new indirect block has its pointers zeroed in memory; it's only written by flush_block_map */
+			if (map.dirty[d])
+			{
+				write_metadata(map.blocknum[d], map.block[d].data);
+			}
+			map.blocknum[d] = *pointer;
+			memset(map.block[d].pointers, 0, sizeof(map.block[d].pointers));
+			map.dirty[d] = true;
+		}
+		else if (map.blocknum[d] != *pointer)
+		{
+			if (map.dirty[d])
+			{
+				write_metadata(map.blocknum[d], map.block[d].data);
+			}
+			read_metadata(*pointer, map.block[d].data);
+			map.blocknum[d] = *pointer;
+			map.dirty[d] = false;
+		}
+
+		pointer = &map.block[d].pointers[offsets[d + 1]];
+		pointerDirty = &map.dirty[d];
+	}
+
+	if (*pointer == 0 && reserved != nullptr)
+	{
+		int freeBlockIndex = take_reserved_block(*reserved);
+		if (freeBlockIndex == -1)
+		{
+			return -1;
+		}
+		*pointer = freeBlockIndex;
+		*pointerDirty = true;
+	}
+	return *pointer;
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::flush_block_map(fs_block_map &map)
+{
+	for (int d = 0; d < MAP_LEVELS; d++)
+	{
+		if (map.dirty[d])
+		{
+			write_metadata(map.blocknum[d], map.block[d].data);
+			map.dirty[d] = false;
+		}
+	}
+}
+
+template <int BLOCK_SIZE>
+bool INE5412_FS::fs_impl<BLOCK_SIZE>::is_extent_inode(const fs_inode &inode)
+{
+	/* An inline inode keeps INODE_EXTENTS for when it moves to blocks, but has no tree meanwhile */
+	return superblock.version >= FS_VERSION_EXTENTS && (inode.isvalid & INODE_EXTENTS) && !is_inline_inode(inode);
+}
+
+template <int BLOCK_SIZE>
+bool INE5412_FS::fs_impl<BLOCK_SIZE>::is_inline_inode(const fs_inode &inode)
+{
+	return superblock.version >= FS_VERSION_INLINE && (inode.isvalid & INODE_INLINE);
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::load_extent_root(const fs_inode &inode, fs_extent_block &root)
+{
+	/* Count, depth and then each entry, one int per pointer field */
+	root.magic = EXTENT_MAGIC;
+	root.count = inode.field(0);
+	root.depth = inode.field(1);
+	for (int i = 0; i < EXTENTS_PER_INODE; i++)
+	{
+		root.extent[i].fileBlock = inode.field(2 + 3 * i);
+		root.extent[i].start = inode.field(3 + 3 * i);
+		root.extent[i].length = inode.field(4 + 3 * i);
+	}
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::store_extent_root(fs_inode &inode, const fs_extent_block &root)
+{
+	inode.field(0) = root.count;
+	inode.field(1) = root.depth;
+	for (int i = 0; i < EXTENTS_PER_INODE; i++)
+	{
+		inode.field(2 + 3 * i) = root.extent[i].fileBlock;
+		inode.field(3 + 3 * i) = root.extent[i].start;
+		inode.field(4 + 3 * i) = root.extent[i].length;
+	}
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::extent_search(const fs_extent_block &node, int fileBlock)
+{
+	/* Binary search for the last entry starting at or before fileBlock, -1 when there is none */
+	int found = -1;
+	int low = 0;
+	int high = node.count - 1;
+	while (low <= high)
+	{
+		int middle = (low + high) / 2;
+		if (node.extent[middle].fileBlock <= fileBlock)
+		{
+			found = middle;
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle - 1;
+		}
+	}
+	return found;
+}
+
+template <int BLOCK_SIZE>
+typename INE5412_FS::fs_impl<BLOCK_SIZE>::fs_extent_block *INE5412_FS::fs_impl<BLOCK_SIZE>::extent_child(fs_block_map &map, int depth, int blocknum)
+{
+	/* The extent block 'depth' levels under the root, read into the map unless it's already there */
+	if (map.blocknum[depth] != blocknum)
+	{
+		if (map.dirty[depth])
+		{
+			write_metadata(map.blocknum[depth], map.block[depth].data);
+		}
+		read_metadata(blocknum, map.block[depth].data);
+		map.blocknum[depth] = blocknum;
+		map.dirty[depth] = false;
+
+		fs_extent_block &node = map.block[depth].extents;
+		node.count = max(0, min(node.count, (int)EXTENTS_PER_BLOCK));
+	}
+	return &map.block[depth].extents;
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::extent_lookup(fs_block_map &map, int fileBlock, int &runLength)
+{
+	/* Disk block of fileBlock, 0 when it has none, and how many blocks from it on are contiguous in its extent */
+	fs_extent_block root;
+	load_extent_root(map.inode, root);
+
+	fs_extent_block *node = &root;
+	for (int d = 0; d < min(root.depth, (int)EXTENT_MAX_DEPTH); d++)
+	{
+		int i = extent_search(*node, fileBlock);
+		if (i < 0)
+		{
+			return 0;
+		}
+		node = extent_child(map, d, node->extent[i].start);
+	}
+
+	int i = extent_search(*node, fileBlock);
+	if (i < 0 || fileBlock >= node->extent[i].fileBlock + node->extent[i].length)
+	{
+		return 0;
+	}
+	runLength = node->extent[i].fileBlock + node->extent[i].length - fileBlock;
+	return node->extent[i].start + fileBlock - node->extent[i].fileBlock;
+}
+
+template <int BLOCK_SIZE>
+bool INE5412_FS::fs_impl<BLOCK_SIZE>::extent_insert(fs_block_map &map, int fileBlock, int blocknum)
+{
+	/*
+	* Maps fileBlock, which has no block yet, to blocknum. The extent that ends right before it grows
+	* when blocknum also follows it on disk, so contiguous allocation keeps a file in a few extents.
+	* Otherwise a new extent goes into the leaf. When the leaf is full, the deepest node with room
+	* takes the entry for a half split off the node under it, or a full root moves down into a new
+	* block and the tree gets one level deeper; then the insertion starts over.
+	*/
+	while (true)
+	{
+		fs_extent_block root;
+		load_extent_root(map.inode, root);
+		bool rootChanged = false;
+		auto changed = [&](int d) {
+			if (d == 0)
+			{
+				rootChanged = true;
+			}
+			else
+			{
+				map.dirty[d - 1] = true;
+			}
+		};
+		auto capacity = [](int d) { return d == 0 ? (int)EXTENTS_PER_INODE : (int)EXTENTS_PER_BLOCK; };
+
+		/* Path from the root down to the leaf where fileBlock goes */
+		fs_extent_block *path[EXTENT_MAX_DEPTH + 1];
+		path[0] = &root;
+		for (int d = 0; d < root.depth; d++)
+		{
+			int i = extent_search(*path[d], fileBlock);
+			if (i < 0)
+			{
+				/* Before everything in the tree: the first entry now starts at fileBlock */
+				i = 0;
+				path[d]->extent[0].fileBlock = fileBlock;
+				changed(d);
+			}
+			path[d + 1] = extent_child(map, d, path[d]->extent[i].start);
+		}
+
+		bool inserted = false;
+		fs_extent_block &leaf = *path[root.depth];
+		int i = extent_search(leaf, fileBlock);
+		if (i >= 0 && leaf.extent[i].fileBlock + leaf.extent[i].length == fileBlock && leaf.extent[i].start + leaf.extent[i].length == blocknum)
+		{
+			leaf.extent[i].length++;
+			changed(root.depth);
+			inserted = true;
+		}
+		else if (leaf.count < capacity(root.depth))
+		{
+			memmove(&leaf.extent[i + 2], &leaf.extent[i + 1], (leaf.count - i - 1) * sizeof(fs_extent));
+			leaf.extent[i + 1].fileBlock = fileBlock;
+			leaf.extent[i + 1].start = blocknum;
+			leaf.extent[i + 1].length = 1;
+			leaf.count++;
+			changed(root.depth);
+			inserted = true;
+		}
+
+		int parent = root.depth - 1;
+		while (!inserted && parent >= 0 && path[parent]->count == capacity(parent))
+		{
+			parent--;
+		}
+
+		std::deque<int> newBlock;
+		if (!inserted && parent < 0)
+		{
+			/* Full all the way up: the root moves down into a new block */
+			if (root.depth >= EXTENT_MAX_DEPTH)
+			{
+				cout << "ERROR! The extent tree can't grow any further!" << endl;
+				return false;
+			}
+			if (allocate_blocks(1, newBlock) == 0)
+			{
+				break;
+			}
+			union fs_block moved;
+			memset(moved.data, 0, BLOCK_SIZE);
+			moved.extents.magic = EXTENT_MAGIC;
+			moved.extents.count = root.count;
+			moved.extents.depth = root.depth;
+			memcpy(moved.extents.extent, root.extent, root.count * sizeof(fs_extent));
+			write_metadata(newBlock.front(), moved.data);
+
+			root.count = 1;
+			root.depth++;
+			root.extent[0].start = newBlock.front();
+			root.extent[0].length = 0;
+			changed(0);
+		}
+		else if (!inserted)
+		{
+			/* Appending leaves the full node as it is and starts the new one with its last entry */
+			fs_extent_block &full = *path[parent + 1];
+			if (allocate_blocks(1, newBlock) == 0)
+			{
+				break;
+			}
+			bool appending = fileBlock > full.extent[full.count - 1].fileBlock;
+			int keep = appending ? full.count - 1 : full.count / 2;
+
+			union fs_block split;
+			memset(split.data, 0, BLOCK_SIZE);
+			split.extents.magic = EXTENT_MAGIC;
+			split.extents.count = full.count - keep;
+			split.extents.depth = full.depth;
+			memcpy(split.extents.extent, full.extent + keep, split.extents.count * sizeof(fs_extent));
+			write_metadata(newBlock.front(), split.data);
+			full.count = keep;
+			changed(parent + 1);
+
+			fs_extent_block &above = *path[parent];
+			int at = extent_search(above, split.extents.extent[0].fileBlock) + 1;
+			memmove(&above.extent[at + 1], &above.extent[at], (above.count - at) * sizeof(fs_extent));
+			above.extent[at].fileBlock = split.extents.extent[0].fileBlock;
+			above.extent[at].start = newBlock.front();
+			above.extent[at].length = 0;
+			above.count++;
+			changed(parent);
+		}
+
+		if (rootChanged)
+		{
+			store_extent_root(map.inode, root);
+			map.inodeChanged = true;
+		}
+		if (inserted)
+		{
+			return true;
+		}
+
+		/* The blocks cached by the map may have moved around the tree */
+		flush_block_map(map);
+		for (int d = 0; d < EXTENT_MAX_DEPTH; d++)
+		{
+			map.blocknum[d] = 0;
+		}
+	}
+
+	/* The disk is full, which allocate_blocks already reported */
+	return false;
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::collect_extents(const fs_inode &inode, std::vector<fs_extent> &extents, std::vector<int> &nodes)
+{
+	/* Depth first, so the extents come out in file order; 'nodes' gets the extent blocks */
+	fs_extent_block root;
+	load_extent_root(inode, root);
+
+	std::function<void(const fs_extent_block &)> walk = [&](const fs_extent_block &node) {
+		for (int i = 0; i < node.count; i++)
+		{
+			if (node.depth == 0)
+			{
+				extents.push_back(node.extent[i]);
+				continue;
+			}
+
+			nodes.push_back(node.extent[i].start);
+			union fs_block child;
+			read_metadata(node.extent[i].start, child.data);
+			if (child.extents.magic == EXTENT_MAGIC && child.extents.depth == node.depth - 1 &&
+				child.extents.count >= 0 && child.extents.count <= EXTENTS_PER_BLOCK)
+			{
+				walk(child.extents);
+			}
+		}
+	};
+	if (root.count >= 0 && root.count <= EXTENTS_PER_INODE && root.depth >= 0 && root.depth <= EXTENT_MAX_DEPTH)
+	{
+		walk(root);
+	}
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::collect_data_pointers(const fs_inode &inode, int firstBlock, int lastBlock, std::vector<int> &pointers)
+{
+	/* Each indirect block on the way is only read once, and only if the range needs it */
+	fs_inode translated = inode;
+	fs_block_map map(translated);
+
+	/* An extent gives every block of the range it covers with a single search */
+	if (is_extent_inode(inode))
+	{
+		for (int i = firstBlock; i <= lastBlock;)
+		{
+			int runLength = 1;
+			int start = extent_lookup(map, i, runLength);
+			if (start == 0)
+			{
+				pointers.push_back(0);
+				i++;
+				continue;
+			}
+			for (int k = 0; k < runLength && i <= lastBlock; k++, i++)
+			{
+				pointers.push_back(start + k);
+			}
+		}
+		return;
+	}
+
+	for (int i = firstBlock; i <= lastBlock; ++i)
+	{
+		int pointer = map_block(map, i, nullptr);
+		if (pointer < 0)
+		{
+			break;
+		}
+		pointers.push_back(pointer);
+	}
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::readahead(int inumber, const fs_inode &inode, long long offset, int length)
+{
+	/* The cache is where prefetched blocks live, so there is nothing to do without it */
+	int maxWindow = min((int)READAHEAD_MAX_BLOCKS, disk->cache_blocks() / 2);
+	if (maxWindow < READAHEAD_MIN_BLOCKS)
+	{
+		return;
+	}
+
+	int endBlock = (int)((offset + length - 1) / BLOCK_SIZE);
+	int lastFileBlock = (int)((inode.size - 1) / BLOCK_SIZE);
+	int firstBlock;
+	int lastBlock;
+
+	/* Readers of the same file share the state, but the prefetch itself happens outside of the lock */
+	{
+		std::lock_guard<std::mutex> readaheadGuard(readaheadLock);
+
+		/* Files that are no longer read would otherwise keep their entries until deleted or unmounted */
+		if (readaheadState.size() >= READAHEAD_MAX_FILES && !readaheadState.count(inumber))
+		{
+			readaheadState.erase(readaheadState.begin());
+		}
+		/* A new entry starts at offset 0, so reading a file from its beginning already counts as sequential */
+		fs_readahead &state = readaheadState[inumber];
+
+		bool sequential = (offset == state.nextOffset);
+		state.nextOffset = offset + length;
+
+		if (!sequential)
+		{
+			/* Random access: starts over with the smallest window */
+			state.window = READAHEAD_MIN_BLOCKS;
+			state.prefetchedUntil = -1;
+			return;
+		}
+
+		/* Only prefetches again once the reader got close to the end of what was already prefetched */
+		if (state.prefetchedUntil >= endBlock + state.window / 2 || max(endBlock, state.prefetchedUntil) >= lastFileBlock)
+		{
+			return;
+		}
+
+		/* Only the blocks after the current range: the reader fetches its own while these are read in the background */
+		firstBlock = max(endBlock + 1, state.prefetchedUntil + 1);
+		lastBlock = min(lastFileBlock, endBlock + state.window);
+
+		/* Sustained sequential access keeps doubling the window */
+		state.prefetchedUntil = lastBlock;
+		state.window = min(state.window * 2, maxWindow);
+	}
+
+	std::vector<int> pointers;
+	collect_data_pointers(inode, firstBlock, lastBlock, pointers);
+
+	std::vector<int> validPointers;
+	for (size_t i = 0; i < pointers.size(); ++i)
+	{
+		if (pointers[i] > 0 && pointers[i] < superblock.nblocks)
+		{
+			validPointers.push_back(pointers[i]);
+		}
+	}
+	disk->prefetch(validPointers);
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::instantiate_bitmap()
+{
+	/* Always setting the metadata bits as 1: the superblock and the whole inode table.
+	This can be done without any checks because this function is only called 
+	after the in-memory superblock was loaded and validated */
+
+	/* Setting bitmap as all 0's */
+	bitmap.reset(superblock.nblocks);
+	/* Every inode starts free; fs_mount sets the valid ones while it scans the inode table */
+	inodeBitmap.reset(superblock.ninodes);
+
+	/* Setting the superblock (index 0) and the inode blocks as 1, so they are never allocated as data */
+	for (int i = 0; i < firstDataBlock; i++)
+	{
+		set_bitmap_bit_by_index(1, i);
+	}
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::set_bitmap_bit_by_index(bool bit, int index)
+{
+	/* Callers hold allocatorLock, or mountLock exclusively */
+	if (index < 0 || index >= bitmap.size())
+	{
+		cout << "ERROR! Block " << index << " is out of the bitmap range!" << endl;
+		return;
+	}
+
+	mark_bitmap_dirty(superblock.bitmapstart + index / (BLOCK_SIZE * 8));
+
+	if (bit)
+	{
+		bitmap.set(index);
+	}
+	else
+	{
+		bitmap.clear(index);
+	}
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::find_first_free_block()
+{
+	std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+
+	/* Next-fit search: metadata blocks are always marked as used, so any free bit is a data block */
+	int pos = bitmap.find_free();
+
+	if (pos == -1)
+	{
+		cout << "ERROR! There are no free blocks!" << endl;
+	}
+	return pos;
+}
+
+template <int BLOCK_SIZE>
+bool INE5412_FS::fs_impl<BLOCK_SIZE>::needs_pending_free(int dataBlocks)
+{
+	/*
+	* Whether mapping 'dataBlocks' new blocks may take more than is free now while the running
+	* transaction has freed blocks, which it would make available by committing. Besides the data,
+	* there may be an indirect or extent block every so many blocks and a few more for the levels above.
+	*/
+	if (dataBlocks == 0)
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+	if (pendingFree.empty())
+	{
+		return false;
+	}
+	long long needed = (long long)dataBlocks + dataBlocks / (EXTENTS_PER_BLOCK / 2) + MAP_LEVELS + 1;
+	return bitmap.size() - bitmap.count_set() < needed;
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::allocate_blocks(int count, std::deque<int> &blocks)
+{
+	/*
+	* Allocates 'count' blocks, preferring a single contiguous run and falling back to the
+	* largest runs available. Returns how many blocks were actually allocated.
+	*/
+	std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+
+	int allocated = 0;
+	while (allocated < count)
+	{
+		int runLength;
+		int runStart = bitmap.find_run(count - allocated, runLength);
+		if (runStart == -1)
+		{
+			cout << "ERROR! There are no free blocks!" << endl;
+			break;
+		}
+
+		for (int i = runStart; i < runStart + runLength; i++)
+		{
+			set_bitmap_bit_by_index(1, i);
+			blocks.push_back(i);
+		}
+		allocated += runLength;
+	}
+	return allocated;
+}
+
+template <int BLOCK_SIZE>
+int INE5412_FS::fs_impl<BLOCK_SIZE>::take_reserved_block(std::deque<int> &blocks)
+{
+	if (blocks.empty())
+	{
+		return -1;
+	}
+
+	int blockIndex = blocks.front();
+	blocks.pop_front();
+	return blockIndex;
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::release_blocks(std::deque<int> &blocks)
+{
+	std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+
+	while (!blocks.empty())
+	{
+		set_bitmap_bit_by_index(0, blocks.front());
+		blocks.pop_front();
+	}
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::release_inode_blocks(fs_inode &inode, int firstBlock)
+{
+	/* Frees the data blocks of the inode from 'firstBlock' on, and the indirect block when nothing is left in it.
+	They are collected first, so the bitmaps are only locked once and never during disk accesses */
+	if (is_inline_inode(inode))
+	{
+		return;
+	}
+
+	std::deque<int> freedBlocks;
+	if (is_extent_inode(inode))
+	{
+		fs_extent_block root;
+		load_extent_root(inode, root);
+		if (release_extents(root, firstBlock, freedBlocks))
+		{
+			root.depth = 0;
+		}
+		store_extent_root(inode, root);
+	}
+	else
+	{
+		for (int k = firstBlock; k < POINTERS_PER_INODE; k++)
+		{
+			if (inode.direct[k] != 0)
+			{
+				freedBlocks.push_back(inode.direct[k]);
+				inode.direct[k] = 0;
+			}
+		}
+
+		for (int level = 1; level <= inode_levels(); level++)
+		{
+			int &root = inode.root(level);
+			if (root != 0 && release_indirect(root, level, firstBlock - level_first_block(level), freedBlocks))
+			{
+				freedBlocks.push_back(root);
+				root = 0;
+			}
+		}
+	}
+
+	if (!has_journal())
+	{
+		release_blocks(freedBlocks);
+		return;
+	}
+
+	/* With a journal, they stay in use until the transaction that frees them is committed */
+	std::lock_guard<std::mutex> allocatorGuard(allocatorLock);
+	pendingFree.insert(pendingFree.end(), freedBlocks.begin(), freedBlocks.end());
+}
+
+template <int BLOCK_SIZE>
+bool INE5412_FS::fs_impl<BLOCK_SIZE>::release_indirect(int blocknum, int level, int firstBlock, std::deque<int> &freedBlocks)
+{
+	/* Frees what the indirect block points to from 'firstBlock' on, counted from its first pointer.
+	Returns true when nothing is left in it, so the caller frees the block itself */
+	union fs_block indirectBlock;
+	read_metadata(blocknum, indirectBlock.data);
+
+	int span = level_span(level);
+	bool changed = false;
+	for (int k = max(firstBlock, 0) / span; k < POINTERS_PER_BLOCK; k++)
+	{
+		int &pointer = indirectBlock.pointers[k];
+		if (pointer == 0)
+		{
+			continue;
+		}
+		if (level == 1 || release_indirect(pointer, level - 1, firstBlock - k * span, freedBlocks))
+		{
+			freedBlocks.push_back(pointer);
+			pointer = 0;
+			changed = true;
+		}
+	}
+
+	if (firstBlock <= 0)
+	{
+		return true;
+	}
+	if (changed)
+	{
+		write_metadata(blocknum, indirectBlock.data);
+	}
+	return false;
+}
+
+template <int BLOCK_SIZE>
+bool INE5412_FS::fs_impl<BLOCK_SIZE>::release_extents(fs_extent_block &node, int firstBlock, std::deque<int> &freedBlocks)
+{
+	/* Frees what the node maps from firstBlock on, going back from its last entry since they are sorted.
+	Returns true when nothing is left in it */
+	while (node.count > 0)
+	{
+		fs_extent &entry = node.extent[node.count - 1];
+		if (node.depth == 0)
+		{
+			int keep = max(0, firstBlock - entry.fileBlock);
+			if (keep >= entry.length)
+			{
+				break;
+			}
+			for (int k = keep; k < entry.length; k++)
+			{
+				freedBlocks.push_back(entry.start + k);
+			}
+			if (keep > 0)
+			{
+				entry.length = keep;
+				break;
+			}
+			node.count--;
+			continue;
+		}
+
+		union fs_block child;
+		read_metadata(entry.start, child.data);
+		child.extents.count = max(0, min(child.extents.count, (int)EXTENTS_PER_BLOCK));
+		size_t freedBefore = freedBlocks.size();
+		if (!release_extents(child.extents, firstBlock, freedBlocks))
+		{
+			if (freedBlocks.size() != freedBefore)
+			{
+				write_metadata(entry.start, child.data);
+			}
+			break;
+		}
+		freedBlocks.push_back(entry.start);
+		node.count--;
+	}
+	return node.count == 0;
+}
+
+template <int BLOCK_SIZE>
+void INE5412_FS::fs_impl<BLOCK_SIZE>::mark_bitmap_dirty(int bitmapBlock)
+{
+	/* Callers hold allocatorLock */
+	if (has_journal())
+	{
+		dirtyBitmapBlocks.insert(bitmapBlock);
+	}
+}
+
+/* Every block size a Disk can have, so each of them is compiled whether it's used or not */
+template class INE5412_FS::fs_impl<1024>;
+template class INE5412_FS::fs_impl<2048>;
+template class INE5412_FS::fs_impl<4096>;
+template class INE5412_FS::fs_impl<8192>;
+template class INE5412_FS::fs_impl<16384>;
+template class INE5412_FS::fs_impl<32768>;
+template class INE5412_FS::fs_impl<65536>;
+
+INE5412_FS::INE5412_FS(Disk *d)
+{
+	disk = d;
+	use_block_size(disk->block_size());
+}
+
+int INE5412_FS::image_block_size(const fs_superblock &super)
+{
+	if (super.version >= FS_VERSION_BLOCK_SIZE && super.version <= FS_VERSION)
+	{
+		return super.blocksize;
+	}
+	return LEGACY_BLOCK_SIZE;
+}
+
+bool INE5412_FS::use_block_size(int blockSize)
+{
+	/* Called with engineLock held exclusively. A mounted file system keeps its engine, which refuses to format */
+	if (engine && (engine->is_mounted() || disk->block_size() == blockSize))
+	{
+		return true;
+	}
+	if (!disk->set_block_size(blockSize))
+	{
+		cout << "Error: Blocks of " << blockSize << " bytes aren't a power of two from " << Disk::MIN_BLOCK_SIZE << " to "
+			 << Disk::MAX_BLOCK_SIZE << ", or don't fit in the disk." << endl;
+		return false;
+	}
+
+	switch (blockSize)
+	{
+	case 1024:
+		engine.reset(new fs_impl<1024>(disk));
+		break;
+	case 2048:
+		engine.reset(new fs_impl<2048>(disk));
+		break;
+	case 4096:
+		engine.reset(new fs_impl<4096>(disk));
+		break;
+	case 8192:
+		engine.reset(new fs_impl<8192>(disk));
+		break;
+	case 16384:
+		engine.reset(new fs_impl<16384>(disk));
+		break;
+	case 32768:
+		engine.reset(new fs_impl<32768>(disk));
+		break;
+	default:
+		engine.reset(new fs_impl<65536>(disk));
+		break;
+	}
+	return true;
+}
+
+bool INE5412_FS::use_image_block_size()
+{
+	if (engine->is_mounted())
+	{
+		return true;
+	}
+
+	/* The superblock is at the start of block 0 whatever the size, so the current one reads it */
+	std::vector<char> block(disk->block_size());
+	fs_superblock super;
+	disk->read(0, block.data());
+	memcpy(&super, block.data(), sizeof(super));
+
+	/* Not a file system: the engine in use says so */
+	if (super.magic != FS_MAGIC)
+	{
+		return true;
+	}
+	return use_block_size(image_block_size(super));
+}
+
+void INE5412_FS::fs_debug()
+{
+	std::shared_lock<std::shared_mutex> engineGuard(engineLock);
+	engine->fs_debug();
+}
+
+int INE5412_FS::fs_format()
+{
+	return fs_format(fs_format_options());
+}
+
+int INE5412_FS::fs_format(const fs_format_options &options)
+{
+	std::unique_lock<std::shared_mutex> engineGuard(engineLock);
+	if (!use_block_size(options.blockSize))
+	{
+		return 0;
+	}
+	return engine->fs_format(options);
+}
+
+int INE5412_FS::fs_mount()
+{
+	std::unique_lock<std::shared_mutex> engineGuard(engineLock);
+	if (!use_image_block_size())
+	{
+		return 0;
+	}
+	return engine->fs_mount();
+}
+
+int INE5412_FS::fs_unmount()
+{
+	std::shared_lock<std::shared_mutex> engineGuard(engineLock);
+	return engine->fs_unmount();
+}
+
+bool INE5412_FS::is_mounted()
+{
+	std::shared_lock<std::shared_mutex> engineGuard(engineLock);
+	return engine->is_mounted();
+}
+
+int INE5412_FS::block_size()
+{
+	std::shared_lock<std::shared_mutex> engineGuard(engineLock);
+	return disk->block_size();
+}
+
+int INE5412_FS::fs_create()
+{
+	std::shared_lock<std::shared_mutex> engineGuard(engineLock);
+	return engine->fs_create();
+}
+
+int INE5412_FS::fs_delete(int inumber)
+{
+	std::shared_lock<std::shared_mutex> engineGuard(engineLock);
+	return engine->fs_delete(inumber);
+}
+
+long long INE5412_FS::fs_getsize(int inumber)
+{
+	std::shared_lock<std::shared_mutex> engineGuard(engineLock);
+	return engine->fs_getsize(inumber);
+}
+
+int INE5412_FS::fs_read(int inumber, char *data, int length, long long offset)
+{
+	std::shared_lock<std::shared_mutex> engineGuard(engineLock);
+	return engine->fs_read(inumber, data, length, offset);
+}
+
+int INE5412_FS::fs_write(int inumber, const char *data, int length, long long offset)
+{
+	std::shared_lock<std::shared_mutex> engineGuard(engineLock);
+	return engine->fs_write(inumber, data, length, offset);
+}
+
+int INE5412_FS::fs_truncate(int inumber, long long size)
+{
+	std::shared_lock<std::shared_mutex> engineGuard(engineLock);
+	return engine->fs_truncate(inumber, size);
+}
+
+int INE5412_FS::fs_fsck()
+{
+	std::unique_lock<std::shared_mutex> engineGuard(engineLock);
+	if (!use_image_block_size())
+	{
+		return -1;
+	}
+	return engine->fs_fsck();
 }
 
-void INE5412_FS::erase_indirect_block(int blockIndex)
+int INE5412_FS::fs_sync()
 {
-	/* TO BE CALLED WHEN ALLOCATING A BLOCK TO BE AN INDIRECT BLOCK, so we avoid utilizing 'dirty' blocks */
-	fs_block emptyBlock;
-	for (int i = 0; i < POINTERS_PER_BLOCK; ++i) {
-        emptyBlock.pointers[i] = 0;
-    }
-	disk->write(blockIndex, emptyBlock.data);
+	std::shared_lock<std::shared_mutex> engineGuard(engineLock);
+	return engine->fs_sync();
 }
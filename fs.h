@@ -1,71 +1,521 @@
 #ifndef FS_H
 #define FS_H
 
+#include "bitmap.h"
 #include "disk.h"
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <set>
+#include <thread>
+#include <unordered_map>
 
 class INE5412_FS
 {
 public:
 	static const unsigned int FS_MAGIC = 0xf0f03410;
-	static const unsigned short int INODES_PER_BLOCK = 128;
+	/* Images formatted before the version field existed read as version 0. Each version adds to the
+	previous one: on-disk bitmaps (2), the journal (3), double and triple indirect blocks (4), extents (5),
+	inline data (6), lazy inode table initialization (7), the block size in the superblock (8), 64-bit file sizes (9) */
+	static const unsigned int FS_VERSION = 9;
+	static const unsigned int FS_VERSION_BITMAPS = 2;
+	static const unsigned int FS_VERSION_JOURNAL = 3;
+	static const unsigned int FS_VERSION_INDIRECT = 4;
+	static const unsigned int FS_VERSION_EXTENTS = 5;
+	static const unsigned int FS_VERSION_INLINE = 6;
+	static const unsigned int FS_VERSION_LAZY_INIT = 7;
+	static const unsigned int FS_VERSION_BLOCK_SIZE = 8;
+	static const unsigned int FS_VERSION_LARGE_FILES = 9;
+	/* Block size of every image formatted before it was recorded */
+	static const int LEGACY_BLOCK_SIZE = 4096;
+	/* Superblock flags; with FS_EXTENTS, files are created with extents instead of block pointers,
+	and with FS_INLINE inodes are larger and small files are kept inside them */
+	static const int FS_CLEAN = 1;
+	static const int FS_EXTENTS = 2;
+	static const int FS_INLINE = 4;
+	/* Set in isvalid, besides 1, for an inode whose pointers hold the root of an extent tree,
+	and for one whose data is kept in the inode itself */
+	static const int INODE_EXTENTS = 2;
+	static const int INODE_INLINE = 4;
+	/* 48-byte inodes with a 64-bit size. From version 4 to 8 the size took 32 bits and inodes 40 bytes; before
+	version 4 they had no double and triple indirect pointers either and took 32 bytes. With FS_INLINE they take
+	72 bytes (64 before version 9), and a file of up to INLINE_DATA_SIZE bytes is stored in place of the pointers */
+	static const unsigned short int INODE_SIZE = 48;
+	static const unsigned short int NARROW_INODE_SIZE = 40;
+	static const unsigned short int LEGACY_INODE_SIZE = 32;
+	static const unsigned short int INLINE_INODE_SIZE = 72;
+	static const unsigned short int NARROW_INLINE_INODE_SIZE = 64;
+	static const unsigned short int INLINE_DATA_SIZE = INLINE_INODE_SIZE - 16;
 	static const unsigned short int POINTERS_PER_INODE = 5;
-	static const unsigned short int POINTERS_PER_BLOCK = 1024;
+	/* Indirect, double indirect and triple indirect */
+	static const unsigned short int INDIRECT_LEVELS = 3;
+	/* Extent tree: entries in the root, kept in the inode, and in each of the blocks below it */
+	static const unsigned int EXTENT_MAGIC = 0x45585431;
+	static const unsigned short int EXTENTS_PER_INODE = 2;
+	/* Levels of nodes with at least 'fanout' entries each it takes to hold 'entries' of them, see EXTENT_MAX_DEPTH */
+	static constexpr int tree_levels(long long fanout, long long entries)
+	{
+		return entries <= fanout ? 1 : 1 + tree_levels(fanout, (entries + fanout - 1) / fanout);
+	}
+	/* Readahead window, in blocks, when a sequential read is detected */
+	static const unsigned short int READAHEAD_MIN_BLOCKS = 8;
+	/* Files whose reads are followed at once; past that, a new one takes the place of another */
+	static const unsigned short int READAHEAD_MAX_FILES = 1024;
+	/* Inode locks: inumbers share a lock only when they are this far apart */
+	static const unsigned short int INODE_LOCKS = 1024;
+	/* Journal blocks: descriptor, commit record and the running transaction's blocks in between */
+	static const unsigned int JOURNAL_MAGIC = 0x4a524e4c;
+	static const unsigned int JOURNAL_COMMIT_MAGIC = 0x434d4954;
+	/* Disks smaller than this are formatted without a journal */
+	static const unsigned short int JOURNAL_MIN_DISK_BLOCKS = 64;
 
-	class fs_superblock /*A total of 16 bytes, 4 bytes each.*/
+	class fs_superblock /*A total of 52 bytes, 4 bytes each.*/
 	{
 	public:
 		unsigned int magic;
 		int nblocks;	  /*Total number of blocks*/
 		int ninodeblocks; /*Number of blocks reserved to store inodes.*/
 		int ninodes;	  /*Number of inodes in these blocks*/
+		unsigned int version;	/*FS_VERSION; the fields below are only meaningful when it matches*/
+		int flags;				/*FS_CLEAN when the file system was unmounted cleanly*/
+		int bitmapstart;		/*First block of the on-disk bitmaps, right after the inode blocks*/
+		int nbitmapblocks;		/*Number of blocks of the free-block bitmap*/
+		int ninodebitmapblocks; /*Number of blocks of the free-inode bitmap, after the free-block bitmap*/
+		int journalstart;		/*First block of the journal, right after the bitmaps (version 3)*/
+		int njournalblocks;		/*Number of blocks of the journal, 0 when there is none*/
+		int ninitinodeblocks;	/*Inode blocks written since format (version 7); the ones after them are all free*/
+		int blocksize;			/*fs_format_options::blockSize (version 8)*/
+	};
+
+	/* Choices made by fs_format, which stay with the image */
+	class fs_format_options
+	{
+	public:
+		bool extents = false;	 /*FS_EXTENTS*/
+		bool inlineData = false; /*FS_INLINE*/
+		bool lazyInit = false;	 /*Leaves the inode table to be zeroed after mounting, see ninitinodeblocks*/
+		int bytesPerInode = 0;	 /*Disk space per inode, which sizes the inode table; 0 gives it 10% of the disk*/
+		int blockSize = Disk::DEFAULT_BLOCK_SIZE; /*A power of two from Disk::MIN_BLOCK_SIZE to Disk::MAX_BLOCK_SIZE*/
+	};
+
+	/* First words of the journal descriptor and commit blocks; the descriptor lists the block numbers after it */
+	class fs_journal_header
+	{
+	public:
+		unsigned int magic;
+		unsigned int sequence;
+		int count;				/*Blocks in the transaction*/
+		unsigned int checksum;	/*Commit block only: covers the descriptor and every logged block*/
 	};
 
 	class fs_inode
 	{
 	public:
-		int isvalid; /*1 for valid*/
-		int size;	 /*bytes*/
+		int isvalid;	/*1 for valid, with INODE_EXTENTS for an extent inode and INODE_INLINE for an inline one*/
+		int reserved;	/*Zero; keeps the size 8-byte aligned*/
+		long long size; /*bytes*/
 		int direct[POINTERS_PER_INODE];
 		int indirect;
+		int doubleindirect; /*Version 4 onwards*/
+		int tripleindirect;
+		char inlineTail[INLINE_INODE_SIZE - INODE_SIZE]; /*Only stored with FS_INLINE*/
+
+		/* Data of an inline inode, from the first pointer on into inlineTail */
+		char *inline_data() { return reinterpret_cast<char *>(direct); }
+		const char *inline_data() const { return reinterpret_cast<const char *>(direct); }
+
+		/* Root of the tree with 'level' levels of indirect blocks, from 1 to INDIRECT_LEVELS */
+		int &root(int level) { return level == 1 ? indirect : (level == 2 ? doubleindirect : tripleindirect); }
+		int root(int level) const { return level == 1 ? indirect : (level == 2 ? doubleindirect : tripleindirect); }
+
+		/* Every pointer field in order; an extent inode keeps the root of its tree in them */
+		int &field(int i) { return i < POINTERS_PER_INODE ? direct[i] : root(i - POINTERS_PER_INODE + 1); }
+		int field(int i) const { return i < POINTERS_PER_INODE ? direct[i] : root(i - POINTERS_PER_INODE + 1); }
+	};
+
+	/*
+	* 'length' blocks of a file from 'fileBlock' on, stored contiguously from disk block 'start'.
+	* Above the leaves, 'start' is the extent block with the entries from 'fileBlock' on.
+	*/
+	class fs_extent
+	{
+	public:
+		int fileBlock;
+		int start;
+		int length;
+	};
+
+	/* Inode as stored from version 4 to 8, NARROW_INODE_SIZE bytes of it without FS_INLINE */
+	class fs_narrow_inode
+	{
+	public:
+		int isvalid;
+		int size;
+		char fields[NARROW_INLINE_INODE_SIZE - 2 * sizeof(int)]; /*From direct on, as in fs_inode*/
+	};
+
+	/* Inode as stored before version 4 */
+	class fs_legacy_inode
+	{
+	public:
+		int isvalid;
+		int size;
+		int direct[POINTERS_PER_INODE];
+		int indirect;
+	};
+
+	/* Sequential access detection for one inode */
+	class fs_readahead
+	{
+	public:
+		long long nextOffset = 0; /*Offset where the next read starts if the access is sequential*/
+		int window = READAHEAD_MIN_BLOCKS; /*Blocks to prefetch after the current read*/
+		int prefetchedUntil = -1; /*Last block of the file already brought into the cache*/
+	};
+
+	/* Indirect block found in the inode table or in another indirect block, read by the second phase of the scan */
+	class fs_scan_indirect
+	{
+	public:
+		int block;
+		int inumber;
+		long long size;	/*Size of the inode, to check the pointers against*/
+		int level;		/*1 when it points to data blocks, 2 or 3 when it points to other indirect blocks*/
+		int firstBlock; /*File block under its first pointer*/
+		bool extents;	/*An extent block instead, with 'level' its depth in the tree*/
+	};
+
+	/* What one worker of the scan found, merged with the other workers at the end */
+	class fs_scan_worker
+	{
+	public:
+		Bitmap blocks; /*Blocks referenced by the inodes this worker scanned*/
+		Bitmap inodes; /*Valid inodes this worker scanned*/
+		std::vector<fs_scan_indirect> indirect;
+		std::vector<std::string> problems; /*Only filled by fsck*/
+	};
+
+	/* What every block size implements, see fs_impl */
+	class fs_engine
+	{
+	public:
+		virtual ~fs_engine() {}
+
+		virtual void fs_debug() = 0;
+		virtual int fs_format(const fs_format_options &options) = 0;
+		virtual int fs_mount() = 0;
+		virtual int fs_unmount() = 0;
+		virtual bool is_mounted() = 0;
+
+		virtual int fs_create() = 0;
+		virtual int fs_delete(int inumber) = 0;
+		virtual long long fs_getsize(int inumber) = 0;
+
+		virtual int fs_read(int inumber, char *data, int length, long long offset) = 0;
+		virtual int fs_write(int inumber, const char *data, int length, long long offset) = 0;
+		virtual int fs_truncate(int inumber, long long size) = 0;
+
+		virtual int fs_fsck() = 0;
+		virtual int fs_sync() = 0;
+	};
+
+	/* The file system on blocks of BLOCK_SIZE bytes, instantiated for each size a Disk can have */
+	template <int BLOCK_SIZE>
+	class fs_impl;
+
+public:
+	INE5412_FS(Disk *d);
+
+	void fs_debug();
+	int fs_format();
+	int fs_format(const fs_format_options &options);
+	int fs_mount();
+	int fs_unmount();
+	bool is_mounted();
+	int block_size();
+
+	int fs_create();
+	int fs_delete(int inumber);
+	long long fs_getsize(int inumber);
+
+	int fs_read(int inumber, char *data, int length, long long offset);
+	int fs_write(int inumber, const char *data, int length, long long offset);
+	int fs_truncate(int inumber, long long size);
+
+	int fs_fsck();
+	int fs_sync();
+
+private:
+	static int image_block_size(const fs_superblock &super);
+	bool use_block_size(int blockSize);
+	bool use_image_block_size();
+
+private:
+	Disk *disk;
+	/* For the block size of the disk. Format, mount and fsck replace it when the image needs another one */
+	std::unique_ptr<fs_engine> engine;
+	/* Shared by every call, and only held exclusively to replace the engine */
+	std::shared_mutex engineLock;
+};
+
+template <int BLOCK_SIZE>
+class INE5412_FS::fs_impl : public INE5412_FS::fs_engine
+{
+public:
+	/* Inodes in each block, for every layout in FS_VERSION_* order */
+	static const unsigned short int INODES_PER_BLOCK = BLOCK_SIZE / INODE_SIZE;
+	static const unsigned short int NARROW_INODES_PER_BLOCK = BLOCK_SIZE / NARROW_INODE_SIZE;
+	static const unsigned short int LEGACY_INODES_PER_BLOCK = BLOCK_SIZE / LEGACY_INODE_SIZE;
+	static const unsigned short int INLINE_INODES_PER_BLOCK = BLOCK_SIZE / INLINE_INODE_SIZE;
+	static const unsigned short int NARROW_INLINE_INODES_PER_BLOCK = BLOCK_SIZE / NARROW_INLINE_INODE_SIZE;
+	static const unsigned short int POINTERS_PER_BLOCK = BLOCK_SIZE / sizeof(int);
+	static const unsigned short int EXTENTS_PER_BLOCK = (BLOCK_SIZE - 3 * sizeof(int)) / (3 * sizeof(int));
+	/* Blocks of the largest file: what the pointers reach, up to the last int file block */
+	static const long long MAX_FILE_BLOCKS = min((long long)INT_MAX,
+		POINTERS_PER_INODE + POINTERS_PER_BLOCK * (1 + POINTERS_PER_BLOCK * (1 + (long long)POINTERS_PER_BLOCK)));
+	/*
+	* Levels of extent blocks under the root. Splits leave every node but the last one of each level
+	* with at least EXTENTS_PER_BLOCK / 2 entries, so with this many levels even a file with an extent
+	* for each of its blocks fits: 5 up to 4 KB blocks, 4 for 8 and 16 KB and 3 above that.
+	*/
+	static const unsigned short int EXTENT_MAX_DEPTH = tree_levels(EXTENTS_PER_BLOCK / 2, MAX_FILE_BLOCKS);
+	/* Indirect or extent blocks on a path from the inode down to the data */
+	static const unsigned short int MAP_LEVELS = max((int)INDIRECT_LEVELS, (int)EXTENT_MAX_DEPTH);
+	/* Upper limit of the readahead window (4 MB) */
+	static const unsigned short int READAHEAD_MAX_BLOCKS = 4 * 1024 * 1024 / BLOCK_SIZE;
+	/* Inode blocks kept by the inode cache (4 MB of inode table) */
+	static const unsigned short int INODE_CACHE_BLOCKS = 4 * 1024 * 1024 / BLOCK_SIZE;
+	/* Inode table or indirect blocks read with a single request while scanning (4 MB) */
+	static const unsigned short int SCAN_BATCH_BLOCKS = 4 * 1024 * 1024 / BLOCK_SIZE;
+	/* Largest journal (4 MB) */
+	static const unsigned short int JOURNAL_MAX_BLOCKS = 4 * 1024 * 1024 / BLOCK_SIZE;
+	/* Inode blocks zeroed at a time after a lazy format (1 MB) */
+	static const unsigned short int LAZY_INIT_STEP_BLOCKS = 1024 * 1024 / BLOCK_SIZE;
+
+	/* Node of an extent tree, sorted by fileBlock. The root has the same count, depth and entries,
+	stored in the pointer fields of the inode, with room for EXTENTS_PER_INODE of them */
+	class fs_extent_block
+	{
+	public:
+		int magic; /*EXTENT_MAGIC*/
+		int count;
+		int depth; /*0 for a leaf, whose entries are extents of data*/
+		fs_extent extent[EXTENTS_PER_BLOCK];
+	};
+
+	/* Inode block held by the inode cache, decoded from whichever layout the image uses */
+	class fs_inode_block
+	{
+	public:
+		fs_inode inode[LEGACY_INODES_PER_BLOCK];
+		std::mutex lock; /*Held while any of its inodes is read or changed, and while the block is written*/
 	};
 
 	union fs_block
 	{
 	public:
 		fs_superblock super;
-		fs_inode inode[INODES_PER_BLOCK];
+		fs_journal_header journal;
+		fs_legacy_inode legacyInode[LEGACY_INODES_PER_BLOCK];
+		fs_extent_block extents;
 		int pointers[POINTERS_PER_BLOCK];
-		char data[Disk::DISK_BLOCK_SIZE];
+		char data[BLOCK_SIZE];
+	};
+
+	/*
+	* Indirect or extent blocks on the last path translated by map_block, one per depth, so the file
+	* blocks that follow only read each of them once. Changes to them are written by flush_block_map.
+	*/
+	class fs_block_map
+	{
+	public:
+		fs_block_map(fs_inode &i) : inode(i) {}
+
+		fs_inode &inode;
+		bool inodeChanged = false;
+		int blocknum[MAP_LEVELS] = {};
+		bool dirty[MAP_LEVELS] = {};
+		fs_block block[MAP_LEVELS];
 	};
 
 public:
-	INE5412_FS(Disk *d)
+	fs_impl(Disk *d)
 	{
 		disk = d;
 	}
 
-	void fs_debug();
-	int fs_format();
-	int fs_mount();
+	~fs_impl()
+	{
+		stop_lazy_init();
+	}
 
-	int fs_create();
-	int fs_delete(int inumber);
-	int fs_getsize(int inumber);
+	void fs_debug() override;
+	int fs_format(const fs_format_options &options) override;
+	int fs_mount() override;
+	int fs_unmount() override;
+	bool is_mounted() override;
+
+	int fs_create() override;
+	int fs_delete(int inumber) override;
+	long long fs_getsize(int inumber) override;
 
-	int fs_read(int inumber, char *data, int length, int offset);
-	int fs_write(int inumber, const char *data, int length, int offset);
+	int fs_read(int inumber, char *data, int length, long long offset) override;
+	int fs_write(int inumber, const char *data, int length, long long offset) override;
+	int fs_truncate(int inumber, long long size) override;
+
+	int fs_fsck() override;
+	int fs_sync() override;
 
 	/* Helper functions */
+	bool load_superblock(const fs_superblock &super);
+	void write_superblock();
+	bool has_bitmap_region();
+	void save_bitmaps();
+	void load_bitmaps();
+	void rebuild_bitmaps();
+	void zero_inode_blocks(int first, int count);
+	void init_inode_blocks(int count);
+	void lazy_init_worker();
+	void stop_lazy_init();
+	bool has_journal();
+	int journal_capacity();
+	void journal_begin();
+	void journal_end();
+	void journal_commit();
+	void journal_wait_commit();
+	void journal_replay();
+	void journal_clear();
+	unsigned int journal_checksum(const std::vector<fs_block> &blocks, int count);
+	void read_metadata(int blocknum, char *data);
+	void write_metadata(int blocknum, const char *data);
+	int scan_workers();
+	void scan_inode_table(std::vector<fs_scan_worker> &workers, bool check);
+	void scan_indirect_blocks(std::vector<fs_scan_worker> &workers, bool check);
+	void merge_scan(std::vector<fs_scan_worker> &workers, Bitmap &blocks, Bitmap &inodes, std::vector<std::string> *problems);
+	void scan_inode(fs_scan_worker &worker, int inumber, const fs_inode &inode, bool check);
+	void scan_indirect(fs_scan_worker &worker, const fs_scan_indirect &entry, const fs_block &block, bool check);
+	void scan_extents(fs_scan_worker &worker, int inumber, long long size, const fs_extent_block &node, bool check);
+	bool scan_block(fs_scan_worker &worker, int blocknum, int inumber, bool check);
+	void decode_inode(const fs_block &block, int index, fs_inode &inode);
+	void encode_inode(fs_block &block, int index, const fs_inode &inode);
+	void load_inode(int inumber, fs_inode &inode);
+	void store_inode(int inumber, const fs_inode &inode);
+	void access_inode(int inumber, fs_inode &inode, bool store);
+	std::shared_mutex &inode_lock(int inumber);
+	int inode_levels();
+	long long max_file_size();
+	int size_blocks(long long size);
+	int level_first_block(int level);
+	int level_span(int level);
+	int block_path(int fileBlock, int offsets[INDIRECT_LEVELS + 1]);
+	int map_block(fs_block_map &map, int fileBlock, std::deque<int> *reserved);
+	void flush_block_map(fs_block_map &map);
+	bool is_extent_inode(const fs_inode &inode);
+	bool is_inline_inode(const fs_inode &inode);
+	void load_extent_root(const fs_inode &inode, fs_extent_block &root);
+	void store_extent_root(fs_inode &inode, const fs_extent_block &root);
+	int extent_search(const fs_extent_block &node, int fileBlock);
+	fs_extent_block *extent_child(fs_block_map &map, int depth, int blocknum);
+	int extent_lookup(fs_block_map &map, int fileBlock, int &runLength);
+	bool extent_insert(fs_block_map &map, int fileBlock, int blocknum);
+	void collect_extents(const fs_inode &inode, std::vector<fs_extent> &extents, std::vector<int> &nodes);
+	int write_file(int inumber, const char *data, int length, long long offset);
+	int truncate_file(int inumber, long long size);
+	int write_range(int inumber, fs_inode &inode, const char *data, int length, long long offset);
+	int move_inline_data(int inumber, fs_inode &inode);
+	void collect_data_pointers(const fs_inode &inode, int firstBlock, int lastBlock, std::vector<int> &pointers);
+	void readahead(int inumber, const fs_inode &inode, long long offset, int length);
 	void instantiate_bitmap();
 	void set_bitmap_bit_by_index(bool bit, int index);
 	int find_first_free_block();
-	void erase_entire_inode(int index);
-	void erase_indirect_block(int blockIndex);
+	bool needs_pending_free(int dataBlocks);
+	int allocate_blocks(int count, std::deque<int> &blocks);
+	int take_reserved_block(std::deque<int> &blocks);
+	void release_blocks(std::deque<int> &blocks);
+	void release_inode_blocks(fs_inode &inode, int firstBlock);
+	bool release_indirect(int blocknum, int level, int firstBlock, std::deque<int> &freedBlocks);
+	bool release_extents(fs_extent_block &node, int firstBlock, std::deque<int> &freedBlocks);
+	void mark_bitmap_dirty(int bitmapBlock);
+
+	/* Keeps the running transaction open while an operation changes metadata, so it's never split between two commits */
+	class fs_operation
+	{
+	public:
+		fs_operation(fs_impl *f) : fs(f) { fs->journal_begin(); }
+		~fs_operation() { fs->journal_end(); }
+
+	private:
+		fs_impl *fs;
+	};
+
 
 private:
 	Disk *disk;
 	bool isMounted = false;
-	std::vector<bool> bitmap;
+	Bitmap bitmap;
+	/* Bit i is set when inode i + 1 is valid */
+	Bitmap inodeBitmap;
+
+	/* In-memory copy of the superblock, validated on mount and set on format */
+	fs_superblock superblock;
+	/* First block after the superblock and the inode blocks */
+	int firstDataBlock = 0;
+	/* Depend on the version and flags of the image, see fs_legacy_inode and FS_INLINE */
+	int inodesPerBlock = INODES_PER_BLOCK;
+	int inodeSize = INODE_SIZE;
+	/*
+	* Inode blocks that are on disk, the rest read as free without being read. Only grows, under
+	* lazyInitLock (taken before any inode lock), once the blocks are zeroed and the superblock says so.
+	* The thread zeroing them runs from mount to unmount, between operations that share mountLock.
+	*/
+	std::atomic<int> initializedInodeBlocks{0};
+	std::mutex lazyInitLock;
+	std::thread lazyInitThread;
+	std::atomic<bool> lazyInitStop{false};
+
+	/* Inode cache: inode table blocks by block number, so an inumber is found with a single hash lookup */
+	std::unordered_map<int, fs_inode_block> inodeCache;
+
+	/* Readahead state of the inodes being read, at most READAHEAD_MAX_FILES of them */
+	std::unordered_map<int, fs_readahead> readaheadState;
+
+	/*
+	* Locks, always taken in this order. Format, mount, unmount, debug and fsck hold mountLock
+	* exclusively, every other operation shares it. Readers of a file share its inode lock and
+	* writers hold it exclusively, so the data and indirect blocks of a file need no other lock.
+	*/
+	std::shared_mutex mountLock;
+	std::shared_mutex inodeLocks[INODE_LOCKS];
+	/* Shared to use a cached inode block (which has its own lock), exclusive to add or drop blocks */
+	std::shared_mutex inodeCacheLock;
+	/* Both bitmaps */
+	std::mutex allocatorLock;
+	std::mutex readaheadLock;
+
+	/*
+	* Running transaction of the journal, protected by journalLock. Metadata blocks changed by the
+	* operations since the last commit wait here, by block number, and only reach their place on
+	* disk once the journal has them. It commits when it's half the journal and no operation is
+	* in progress, on fs_sync and on unmount, or as soon as it can when commitRequested is set.
+	*/
+	std::map<int, fs_block> journalBlocks;
+	unsigned int journalSequence = 0;
+	int journalOperations = 0;
+	/* Set by journal_wait_commit: no operation joins the transaction until it's committed */
+	bool commitRequested = false;
+	std::mutex journalLock;
+	std::condition_variable journalIdle;
+	/* Protected by allocatorLock: bitmap blocks to copy into the transaction when it commits, and
+	blocks freed since the last commit, which can't be reused before it or a crash could show new
+	data in a file that still owns them */
+	std::set<int> dirtyBitmapBlocks;
+	std::vector<int> pendingFree;
 };
 
 #endif
\ No newline at end of file
@@ -8,7 +8,7 @@
 class File_Ops
 {
 public:
-    static int do_copyin(const char *filename, int inumber, INE5412_FS *fs);
+    static int do_copyin(const char *filename, int inumber, INE5412_FS *fs, bool sparse);
 
     static int do_copyout(int inumber, const char *filename, INE5412_FS *fs);
 
@@ -22,15 +22,38 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
+	char arg3[1024];
 	int inumber, result, args;
+	long long size;
 
-	if(argc != 3) {
-		cout << "use: " << argv[0] << " <diskfile> <nblocks>\n";
+	int cacheblocks = Disk::DEFAULT_CACHE_BLOCKS;
+	bool writeback = false;
+	bool mapped = false;
+	bool uring = true;
+
+	if(argc < 3) {
+		cout << "use: " << argv[0] << " <diskfile> <nblocks> [-cache <blocks>] [-writeback] [-mmap] [-no-uring]\n";
 		return 1;
 	}
 
+	for(int i = 3; i < argc; i++) {
+		if(!strcmp(argv[i], "-cache") && i + 1 < argc) {
+			cacheblocks = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "-writeback")) {
+			writeback = true;
+		} else if(!strcmp(argv[i], "-mmap")) {
+			mapped = true;
+		} else if(!strcmp(argv[i], "-no-uring")) {
+			uring = false;
+		} else {
+			cout << "unknown option: " << argv[i] << "\n";
+			return 1;
+		}
+	}
+
 
-    Disk disk(argv[1], atoi(argv[2]));
+    Disk disk(argv[1], atoi(argv[2]), cacheblocks, mapped, uring);
+    disk.set_writeback(writeback);
 
     INE5412_FS fs(&disk);
 
@@ -48,20 +71,40 @@ int main( int argc, char *argv[] )
 
 		line[strlen(line)-1] = 0;
 
-		args = sscanf(line,"%s %s %s", cmd, arg1, arg2);
+		args = sscanf(line,"%s %s %s %s", cmd, arg1, arg2, arg3);
 
 		if(args == 0) 
             continue;
 
 		if(!strcmp(cmd, "format")) {
-			if(args == 1) {
-				if(fs.fs_format()) {
+			INE5412_FS::fs_format_options options;
+			bool valid = true;
+			char option[1024];
+			int used;
+			/* Any number of options, so they're read one at a time after the command */
+			for(const char *rest = strstr(line, cmd) + strlen(cmd); sscanf(rest, "%s%n", option, &used) == 1; rest += used) {
+				if(!strcmp(option, "extents")) {
+					options.extents = true;
+				} else if(!strcmp(option, "inline")) {
+					options.inlineData = true;
+				} else if(!strcmp(option, "lazy")) {
+					options.lazyInit = true;
+				} else if(!strncmp(option, "inode-ratio=", 12) && atoi(option + 12) > 0) {
+					options.bytesPerInode = atoi(option + 12);
+				} else if(!strncmp(option, "block-size=", 11) && atoi(option + 11) > 0) {
+					options.blockSize = atoi(option + 11);
+				} else {
+					valid = false;
+				}
+			}
+			if(valid) {
+				if(fs.fs_format(options)) {
 					cout << "disk formatted.\n";
 				} else {
 					cout << "format failed!\n";
 				}
 			} else {
-				cout << "use: format\n";
+				cout << "use: format [extents] [inline] [lazy] [inode-ratio=<bytes>] [block-size=<bytes>]\n";
 			}
 		} else if(!strcmp(cmd, "mount")) {
 			if(args == 1) {
@@ -73,6 +116,16 @@ int main( int argc, char *argv[] )
 			} else {
 				cout << "use: mount\n";
 			}
+		} else if(!strcmp(cmd, "unmount")) {
+			if(args == 1) {
+				if(fs.fs_unmount()) {
+					cout << "disk unmounted.\n";
+				} else {
+					cout << "unmount failed!\n";
+				}
+			} else {
+				cout << "use: unmount\n";
+			}
 		} else if(!strcmp(cmd, "debug")) {
 			if(args == 1) {
 				fs.fs_debug();
@@ -82,9 +135,9 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd, "getsize")) {
 			if(args == 2) {
 				inumber = atoi(arg1);
-				result = fs.fs_getsize(inumber);
-				if(result >= 0) {
-					cout << "inode " << inumber << " has size " << result << "\n";
+				size = fs.fs_getsize(inumber);
+				if(size >= 0) {
+					cout << "inode " << inumber << " has size " << size << "\n";
 				} else {
 					cout << "getsize failed!\n";
 				}
@@ -125,15 +178,15 @@ int main( int argc, char *argv[] )
 			}
 
 		} else if(!strcmp(cmd,"copyin")) {
-			if(args==3) {
+			if(args==3 || (args==4 && !strcmp(arg3, "sparse"))) {
 				inumber = atoi(arg2);
-				if(File_Ops::do_copyin(arg1, inumber, &fs)) {
+				if(File_Ops::do_copyin(arg1, inumber, &fs, args==4)) {
 					cout << "copied file " << arg1 << " to inode " << inumber << "\n";
 				} else {
 					cout << "copy failed!\n";
 				}
 			} else {
-				cout << "use: copyin <filename> <inumber>\n";
+				cout << "use: copyin <filename> <inumber> [sparse]\n";
 			}
 
 		} else if(!strcmp(cmd, "copyout")) {
@@ -148,16 +201,55 @@ int main( int argc, char *argv[] )
 				cout << "use: copyout <inumber> <filename>\n";
 			}
 
+		} else if(!strcmp(cmd, "truncate")) {
+			if(args == 3) {
+				inumber = atoi(arg1);
+				size = atoll(arg2);
+				if(fs.fs_truncate(inumber, size)) {
+					cout << "inode " << inumber << " truncated to " << size << " bytes.\n";
+				} else {
+					cout << "truncate failed!\n";
+				}
+			} else {
+				cout << "use: truncate <inumber> <size>\n";
+			}
+
+		} else if(!strcmp(cmd, "fsck")) {
+			if(args == 1) {
+				result = fs.fs_fsck();
+				if(result == 0) {
+					cout << "no problems found.\n";
+				} else if(result > 0) {
+					cout << result << " problems found.\n";
+				} else {
+					cout << "fsck failed!\n";
+				}
+			} else {
+				cout << "use: fsck\n";
+			}
+
+		} else if(!strcmp(cmd, "sync")) {
+			if(args == 1) {
+				fs.fs_sync();
+				cout << "disk synced.\n";
+			} else {
+				cout << "use: sync\n";
+			}
+
 		} else if(!strcmp(cmd, "help")) {
 			cout << "Commands are:\n";
-			cout << "    format\n";
+			cout << "    format  [extents] [inline] [lazy] [inode-ratio=<bytes>] [block-size=<bytes>]\n";
 			cout << "    mount\n";
+			cout << "    unmount\n";
 			cout << "    debug\n";
 			cout << "    create\n";
 			cout << "    delete  <inode>\n";
 			cout << "    cat     <inode>\n";
-			cout << "    copyin  <file> <inode>\n";
+			cout << "    copyin  <file> <inode> [sparse]\n";
 			cout << "    copyout <inode> <file>\n";
+			cout << "    truncate <inode> <size>\n";
+			cout << "    fsck\n";
+			cout << "    sync\n";
 			cout << "    help\n";
 			cout << "    quit\n";
 			cout << "    exit\n";
@@ -172,17 +264,47 @@ int main( int argc, char *argv[] )
 		}
 	}
 
+	/* Leaving without unmounting would force a full scan on the next mount */
+	if(fs.is_mounted()) {
+		fs.fs_unmount();
+	}
+
 	cout << "closing emulated disk.\n";
 	disk.close();
 
 	return 0;
 }
 
-int File_Ops::do_copyin(const char *filename, int inumber, INE5412_FS *fs)
+/* Writes part of a buffer read by do_copyin, returning 0 if the file system couldn't take all of it */
+static int copyin_write(INE5412_FS *fs, int inumber, const char *data, int length, long long offset)
+{
+	if(length <= 0) return 1;
+
+	int actual = fs->fs_write(inumber, data, length, offset);
+	if(actual < 0) {
+		cout << "ERROR: fs_write return invalid result " << actual << "\n";
+		return 0;
+	}
+	if(actual != length) {
+		cout << "WARNING: fs_write only wrote " << actual << " bytes, not " << length << " bytes\n";
+		return 0;
+	}
+	return 1;
+}
+
+static bool is_zero(const char *data, int length)
+{
+	return data[0] == 0 && !memcmp(data, data + 1, length - 1);
+}
+
+int File_Ops::do_copyin(const char *filename, int inumber, INE5412_FS *fs, bool sparse)
 {
 	FILE *file;
-	int offset=0, result, actual;
-	char buffer[16384];
+	long long offset=0;
+	int result;
+	/* At least a block, so 'sparse' sees whole blocks whatever the block size */
+	int blockSize = fs->block_size();
+	vector<char> buffer(max(16384, blockSize));
 
 	file = fopen(filename, "r");
 	if(!file) {
@@ -190,34 +312,59 @@ int File_Ops::do_copyin(const char *filename, int inumber, INE5412_FS *fs)
 		return 0;
 	}
 
-	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
+	/* fs_write overwrites in place, so the old content is dropped first to replace the whole file */
+	if(!fs->fs_truncate(inumber, 0)) {
+		fclose(file);
+		return 0;
+	}
+
+	/*
+	* With 'sparse', blocks that are all zeros are skipped and left as holes. The buffer holds whole
+	* blocks of the file, so each chunk of it is one block; the rest is written in runs as large as possible.
+	*/
+	bool complete = true;
+	while(complete) {
+		result = fread(buffer.data(),1,buffer.size(),file);
 		if(result <= 0) break;
-		if(result > 0) {
-			actual = fs->fs_write(inumber,buffer,result,offset);
-			if(actual<0) {
-				cout << "ERROR: fs_write return invalid result " << actual << "\n";
-				break;
-			}
-			offset += actual;
-			if(actual!=result) {
-				cout << "WARNING: fs_write only wrote " << actual << " bytes, not " << result << " bytes\n";
-				break;
+
+		int runStart = 0;
+		for(int chunk = 0; sparse && chunk < result; chunk += blockSize) {
+			int chunkLength = min(blockSize, result - chunk);
+			if(is_zero(buffer.data() + chunk, chunkLength)) {
+				complete = copyin_write(fs, inumber, buffer.data() + runStart, chunk - runStart, offset + runStart);
+				runStart = chunk + chunkLength;
+				if(!complete) break;
 			}
 		}
+		if(complete) {
+			complete = copyin_write(fs, inumber, buffer.data() + runStart, result - runStart, offset + runStart);
+		}
+		if(complete) {
+			offset += result;
+		}
+	}
+
+	/* A file that ends with zeros still needs its full size */
+	if(complete && fs->fs_getsize(inumber) < offset && !fs->fs_truncate(inumber, offset)) {
+		complete = false;
+	}
+	if(!complete) {
+		offset = max(fs->fs_getsize(inumber), 0LL);
 	}
 
 	cout << offset << " bytes copied\n";
 
     fclose(file);
 
-	return 1;
+	/* Only part of the file made it, so the copy failed */
+	return complete;
 }
 
 int File_Ops::do_copyout(int inumber, const char *filename, INE5412_FS *fs)
 {
 	FILE *file;
-	int offset = 0, result;
+	long long offset = 0;
+	int result;
 	char buffer[16384];
 
 	file = fopen(filename,"w");
@@ -0,0 +1,125 @@
+#include "fs.h"
+#include "disk.h"
+#include "bitmap.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+* Block allocation micro-benchmark.
+* Fills a bitmap the size of the image with the old allocator (a linear scan over a
+* vector<bool> from the first data block on every allocation) and with Bitmap, then
+* fills a real image through fs_write and reports the allocations per second of each.
+*/
+
+using namespace std;
+using namespace std::chrono;
+
+static double seconds_since(steady_clock::time_point start)
+{
+	return duration<double>(steady_clock::now() - start).count();
+}
+
+/* The allocator Bitmap replaced: always starts over from the first data block */
+static int linear_find_free(const vector<bool> &bitmap, int startIndex)
+{
+	for (int i = startIndex; i < (int)bitmap.size(); i++)
+	{
+		if (bitmap.at(i) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *image = argc > 1 ? argv[1] : "tests/alloc_bench.img";
+	int nblocks = argc > 2 ? atoi(argv[2]) : 131072;
+	/* The old scan is quadratic, so it only runs for this long */
+	double budget = argc > 3 ? atof(argv[3]) : 5.0;
+
+	if (nblocks < 100)
+	{
+		printf("use: %s [image] [nblocks >= 100] [seconds for the linear scan]\n", argv[0]);
+		return 1;
+	}
+
+	/* Same split as fs_format: 10% of the blocks for inodes, plus the superblock */
+	int firstData = nblocks / 10 + 1;
+	int dataBlocks = nblocks - firstData;
+
+	/* Before: linear scan */
+	vector<bool> linear(nblocks, false);
+	long long linearCount = 0;
+	steady_clock::time_point start = steady_clock::now();
+	while (seconds_since(start) < budget)
+	{
+		int block = linear_find_free(linear, firstData);
+		if (block == -1)
+		{
+			break;
+		}
+		linear[block] = true;
+		linearCount++;
+	}
+	double linearTime = seconds_since(start);
+
+	/* After: word bitmap with next-fit hint and summary level */
+	Bitmap bitmap(nblocks);
+	for (int i = 0; i < firstData; i++)
+	{
+		bitmap.set(i);
+	}
+	long long bitmapCount = 0;
+	start = steady_clock::now();
+	for (int block = bitmap.find_free(); block != -1; block = bitmap.find_free())
+	{
+		bitmap.set(block);
+		bitmapCount++;
+	}
+	double bitmapTime = seconds_since(start);
+
+	printf("%d blocks, %d data blocks\n", nblocks, dataBlocks);
+	printf("linear scan: %lld allocations in %.3f s, %.0f allocations/s%s\n", linearCount, linearTime,
+		   linearCount / linearTime, linearCount < dataBlocks ? " (stopped early)" : "");
+	printf("bitmap:      %lld allocations in %.3f s, %.0f allocations/s\n", bitmapCount, bitmapTime,
+		   bitmapCount / bitmapTime);
+
+	/* The whole file system: one file written 1 MB at a time until the disk is full */
+	unlink(image);
+	Disk disk(image, nblocks, 0);
+	INE5412_FS fs(&disk);
+	if (!fs.fs_format() || !fs.fs_mount())
+	{
+		printf("could not format %s\n", image);
+		return 1;
+	}
+
+	int inumber = fs.fs_create();
+	vector<char> chunk(1024 * 1024, 'x');
+	long long offset = 0;
+	start = steady_clock::now();
+	while (true)
+	{
+		int written = fs.fs_write(inumber, chunk.data(), chunk.size(), offset);
+		offset += written;
+		if (written < (int)chunk.size())
+		{
+			break;
+		}
+	}
+	double fsTime = seconds_since(start);
+	long long fsBlocks = (offset + disk.block_size() - 1) / disk.block_size();
+
+	printf("fs_write:    %lld blocks in %.3f s, %.0f allocations/s\n", fsBlocks, fsTime, fsBlocks / fsTime);
+
+	fs.fs_unmount();
+	disk.close();
+	unlink(image);
+	return 0;
+}
@@ -0,0 +1,206 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+* Journal tests: blocks freed by the running transaction must be usable by a later operation
+* once it commits, and the image must survive crashes at the points the journal protects:
+* a commit is replayed when its checkpoint was lost, a torn one is ignored, and work that was
+* never committed leaves a consistent image.
+*/
+
+using namespace std;
+
+static const char *IMAGE = "tests/journal.img";
+
+static vector<char> pattern(int length, int seed)
+{
+	vector<char> data(length);
+	srand(seed);
+	for (int i = 0; i < length; i++)
+	{
+		data[i] = rand();
+	}
+	return data;
+}
+
+static bool same_content(INE5412_FS &fs, int inumber, const vector<char> &expected)
+{
+	vector<char> buffer(expected.size() + 1);
+	int read = fs.fs_read(inumber, buffer.data(), buffer.size(), 0);
+	return read == (int)expected.size() && !memcmp(buffer.data(), expected.data(), read);
+}
+
+static bool rewrite_test()
+{
+	/*
+	* A file taking more than half the free space is dropped and written again. Its old blocks are
+	* only free once the truncate is committed, so the second write depends on that commit.
+	*/
+	int nblocks = 1000;
+	unlink(IMAGE);
+	Disk disk(IMAGE, nblocks, 0);
+	INE5412_FS fs(&disk);
+	if (!fs.fs_format() || !fs.fs_mount())
+	{
+		printf("FAIL: could not format %s\n", IMAGE);
+		return false;
+	}
+
+	/* About 60% of the disk, written in small pieces like copyin does */
+	int length = nblocks * 6 / 10 * Disk::DEFAULT_BLOCK_SIZE;
+	int inumber = fs.fs_create();
+	for (int round = 0; round < 2; round++)
+	{
+		vector<char> data = pattern(length, round);
+		if (!fs.fs_truncate(inumber, 0))
+		{
+			printf("FAIL: truncate before rewrite %d\n", round);
+			return false;
+		}
+		for (int offset = 0; offset < length; offset += 16384)
+		{
+			int piece = min(16384, length - offset);
+			if (fs.fs_write(inumber, data.data() + offset, piece, offset) != piece)
+			{
+				printf("FAIL: rewrite %d stopped at %d of %d bytes\n", round, offset, length);
+				return false;
+			}
+		}
+		if (!same_content(fs, inumber, data))
+		{
+			printf("FAIL: content after rewrite %d\n", round);
+			return false;
+		}
+	}
+
+	fs.fs_unmount();
+	if (fs.fs_fsck() != 0)
+	{
+		printf("FAIL: fsck after the rewrites\n");
+		return false;
+	}
+	disk.close();
+	return true;
+}
+
+/* What goes wrong after the last fs_sync, before the crash */
+enum crash_damage
+{
+	/* The inode block the commit wrote in place never reached the disk, so only the journal has it */
+	LOST_CHECKPOINT,
+	/* The committed record was torn, so its checksum fails and it must not be replayed */
+	TORN_RECORD,
+	/* Operations after the sync were never committed */
+	UNCOMMITTED_WORK
+};
+
+static bool crash_test(crash_damage damage, const char *name)
+{
+	int nblocks = 4000;
+	vector<int> inumbers;
+	vector<vector<char>> contents;
+
+	unlink(IMAGE);
+	{
+		Disk disk(IMAGE, nblocks, 64);
+		INE5412_FS fs(&disk);
+		if (!fs.fs_format() || !fs.fs_mount())
+		{
+			printf("FAIL: could not format %s\n", IMAGE);
+			return false;
+		}
+
+		for (int i = 0; i < 6; i++)
+		{
+			inumbers.push_back(fs.fs_create());
+			contents.push_back(pattern(5000 + i * 30000, i));
+			fs.fs_write(inumbers[i], contents[i].data(), contents[i].size(), 0);
+		}
+		fs.fs_sync();
+
+		if (damage == UNCOMMITTED_WORK)
+		{
+			for (int i = 0; i < 6; i++)
+			{
+				vector<char> data = pattern(90000, i + 50);
+				fs.fs_truncate(inumbers[i], 0);
+				fs.fs_write(inumbers[i], data.data(), data.size(), 0);
+			}
+			fs.fs_delete(inumbers[0]);
+			fs.fs_create();
+		}
+
+		vector<char> block(disk.block_size());
+		INE5412_FS::fs_superblock super;
+		disk.read(0, block.data());
+		memcpy(&super, block.data(), sizeof(super));
+
+		if (damage == LOST_CHECKPOINT)
+		{
+			/* Block 1 is the first inode block, which holds every file of the test */
+			memset(block.data(), 0, block.size());
+			disk.write(1, block.data());
+		}
+		else if (damage == TORN_RECORD)
+		{
+			/* The first block logged after the descriptor */
+			disk.read(super.journalstart + 1, block.data());
+			block[100] ^= 1;
+			disk.write(super.journalstart + 1, block.data());
+		}
+
+		/* The crash: the image is left as it is, without unmounting */
+		disk.close();
+	}
+
+	Disk disk(IMAGE, nblocks, 0);
+	INE5412_FS fs(&disk);
+	if (!fs.fs_mount())
+	{
+		printf("FAIL: %s: could not mount after the crash\n", name);
+		return false;
+	}
+
+	/* Uncommitted work may or may not be there, but what was synced before must be intact */
+	if (damage != UNCOMMITTED_WORK)
+	{
+		for (size_t i = 0; i < inumbers.size(); i++)
+		{
+			if (!same_content(fs, inumbers[i], contents[i]))
+			{
+				printf("FAIL: %s: content of inode %d after the crash\n", name, inumbers[i]);
+				return false;
+			}
+		}
+	}
+
+	fs.fs_unmount();
+	if (fs.fs_fsck() != 0)
+	{
+		printf("FAIL: %s: fsck after the crash\n", name);
+		return false;
+	}
+	disk.close();
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if (!rewrite_test() ||
+		!crash_test(LOST_CHECKPOINT, "lost checkpoint") ||
+		!crash_test(TORN_RECORD, "torn record") ||
+		!crash_test(UNCOMMITTED_WORK, "uncommitted work"))
+	{
+		return 1;
+	}
+
+	unlink(IMAGE);
+	printf("journal: OK\n");
+	return 0;
+}
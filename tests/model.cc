@@ -0,0 +1,396 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <algorithm>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+* Model check of the inode formats.
+* Random writes, truncates, deletes and reads on a few files, each checked against a copy kept
+* in memory. fs_fsck runs every so often, and at the end the files are read back after mounting
+* the image again. Files often shrink back to around INLINE_DATA_SIZE, so with inline data they
+* keep moving in and out of their inodes. With holes, writes also land past the end of the file
+* and truncates grow it, leaving holes that must read back as zeros. With fragment, a single extent
+* file gets an extent per block instead, until the disk is full.
+*/
+
+using namespace std;
+
+static const int FILES = 8;
+/* Writes past the end and growing truncates stop here, so the copies stay small */
+static const int MAX_FILE_SIZE = 16 * 1024 * 1024;
+
+class model_options
+{
+public:
+	const char *image = "tests/model.img";
+	int nblocks = 30000;
+	int operations = 6000;
+	unsigned int seed = 1;
+	bool holes = false;
+	bool fragment = false;
+	INE5412_FS::fs_format_options format;
+};
+
+class model_file
+{
+public:
+	int inumber;
+	vector<char> content;
+};
+
+static bool same_content(INE5412_FS &fs, const model_file &file)
+{
+	vector<char> buffer(file.content.size() + 1);
+	int read = fs.fs_read(file.inumber, buffer.data(), buffer.size(), 0);
+	return read == (int)file.content.size() && !memcmp(buffer.data(), file.content.data(), read);
+}
+
+/* Holes take no blocks, so a file can end well past the size of the disk */
+static bool far_write_test(INE5412_FS &fs, const model_options &options)
+{
+	long long offset = 2LL * options.nblocks * Disk::DEFAULT_BLOCK_SIZE;
+	int blockSize = fs.block_size();
+	int inumber = fs.fs_create();
+	if (fs.fs_write(inumber, "x", 1, offset) != 1 || fs.fs_getsize(inumber) != offset + 1)
+	{
+		printf("FAIL: write at %lld, past the end of the disk\n", offset);
+		return false;
+	}
+
+	vector<char> buffer(blockSize + 1);
+	long long offsets[] = {0, offset / 2, offset - blockSize};
+	for (long long hole : offsets)
+	{
+		if (fs.fs_read(inumber, buffer.data(), buffer.size(), hole) != (int)buffer.size())
+		{
+			printf("FAIL: read of the hole at %lld\n", hole);
+			return false;
+		}
+		for (size_t i = 0; i + 1 < buffer.size(); i++)
+		{
+			if (buffer[i] != 0)
+			{
+				printf("FAIL: the hole at %lld does not read as zeros\n", hole);
+				return false;
+			}
+		}
+		if (hole == offset - blockSize && buffer.back() != 'x')
+		{
+			printf("FAIL: the byte after the hole\n");
+			return false;
+		}
+	}
+	return fs.fs_delete(inumber);
+}
+
+/*
+* Fragmentation: one block at every other file block, written from the end of the file backwards so
+* every leaf splits in half, until the disk is full. A full disk must give a clean short write, with
+* the extent tree still readable by fs_read and accepted by fs_fsck, and then after mounting again.
+*/
+static bool check_fragments(INE5412_FS &fs, int inumber, int first, int last, int blockSize)
+{
+	vector<char> buffer(2 * blockSize);
+	for (int k = first; k <= last; k++)
+	{
+		/* With the hole after it, but the last one ends the file */
+		int length = k < last ? 2 * blockSize : blockSize;
+		if (fs.fs_read(inumber, buffer.data(), length, 2LL * k * blockSize) != length)
+		{
+			printf("FAIL: read of fragment %d\n", k);
+			return false;
+		}
+		for (int i = 0; i < length; i++)
+		{
+			if (buffer[i] != (i < blockSize ? (char)k : 0))
+			{
+				printf("FAIL: content of fragment %d\n", k);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool run_fragment(const model_options &options)
+{
+	unlink(options.image);
+	Disk disk(options.image, options.nblocks, 128);
+	INE5412_FS fs(&disk);
+	if (!fs.fs_format(options.format) || !fs.fs_mount())
+	{
+		printf("FAIL: could not format %s\n", options.image);
+		return false;
+	}
+
+	int blockSize = fs.block_size();
+	int inumber = fs.fs_create();
+	int last = disk.size();
+	int first = last;
+	vector<char> block(blockSize);
+	while (true)
+	{
+		/* The hole after each fragment keeps it from extending the extent of the one written before */
+		memset(block.data(), (char)first, blockSize);
+		int written = fs.fs_write(inumber, block.data(), blockSize, 2LL * first * blockSize);
+		if (written == 0)
+		{
+			break;
+		}
+		if (written != blockSize || first == 0)
+		{
+			printf("FAIL: fragment %d wrote %d bytes\n", first, written);
+			return false;
+		}
+		first--;
+	}
+	first++;
+
+	/* It was the disk that ran out, not room in the tree */
+	int other = fs.fs_create();
+	if (fs.fs_write(other, block.data(), blockSize, 0) != 0 || !fs.fs_delete(other))
+	{
+		printf("FAIL: fragment %d was refused with room left on the disk\n", first - 1);
+		return false;
+	}
+
+	if (fs.fs_getsize(inumber) != (2LL * last + 1) * blockSize || !check_fragments(fs, inumber, first, last, blockSize) ||
+		fs.fs_fsck() != 0)
+	{
+		printf("FAIL: file of %d fragments on a full disk\n", last - first + 1);
+		return false;
+	}
+	fs.fs_unmount();
+	disk.close();
+
+	Disk diskAgain(options.image, options.nblocks, 0);
+	INE5412_FS fsAgain(&diskAgain);
+	if (!fsAgain.fs_mount() || !check_fragments(fsAgain, inumber, first, last, blockSize) ||
+		!fsAgain.fs_delete(inumber) || fsAgain.fs_fsck() != 0)
+	{
+		printf("FAIL: file of %d fragments after mounting again\n", last - first + 1);
+		return false;
+	}
+	fsAgain.fs_unmount();
+	diskAgain.close();
+	unlink(options.image);
+	printf("model: %d fragments on a full disk, %d-byte blocks: OK\n", last - first + 1, blockSize);
+	return true;
+}
+
+static bool run_model(const model_options &options)
+{
+	mt19937 generator(options.seed);
+	vector<model_file> files(FILES);
+	int blockSize = options.format.blockSize;
+	vector<char> buffer(20 * blockSize);
+
+	unlink(options.image);
+	Disk disk(options.image, options.nblocks, 128);
+	INE5412_FS fs(&disk);
+	if (!fs.fs_format(options.format) || !fs.fs_mount())
+	{
+		printf("FAIL: could not format %s\n", options.image);
+		return false;
+	}
+	if (options.holes && !far_write_test(fs, options))
+	{
+		return false;
+	}
+	for (int i = 0; i < FILES; i++)
+	{
+		files[i].inumber = fs.fs_create();
+	}
+
+	for (int op = 0; op < options.operations; op++)
+	{
+		model_file &file = files[generator() % FILES];
+		int size = file.content.size();
+		int choice = generator() % 20;
+
+		if (choice < 12)
+		{
+			/* Mostly appends of up to a block, which keep extending the same runs, sometimes tiny, larger or inside the file */
+			int length = 1 + generator() % (generator() % 4 ? blockSize : buffer.size());
+			if (generator() % 3 == 0)
+			{
+				length = 1 + generator() % (INE5412_FS::INLINE_DATA_SIZE / 2);
+			}
+			long long offset = size;
+			if (generator() % 5 == 0)
+			{
+				offset = generator() % (size + 1);
+			}
+			else if (options.holes && generator() % 4 == 0)
+			{
+				offset = min((long long)(size + generator() % (8 * 1024 * 1024)), (long long)MAX_FILE_SIZE - length);
+			}
+			for (int i = 0; i < length; i++)
+			{
+				buffer[i] = generator();
+			}
+
+			int written = fs.fs_write(file.inumber, buffer.data(), length, offset);
+			if (written != length)
+			{
+				printf("FAIL: operation %d wrote %d of %d bytes\n", op, written, length);
+				return false;
+			}
+			if (offset + written > size)
+			{
+				file.content.resize(offset + written);
+			}
+			memcpy(file.content.data() + offset, buffer.data(), written);
+		}
+		else if (choice < 14)
+		{
+			/* Either a little or a lot comes off the end, or the file goes back to about what fits in an inode */
+			int cut = generator() % (size / (generator() % 2 ? 1 : 8) + 1);
+			if (generator() % 2)
+			{
+				cut = size - min(size, (int)(generator() % (2 * INE5412_FS::INLINE_DATA_SIZE)));
+			}
+			else if (options.holes && generator() % 2)
+			{
+				/* Growing instead, which adds a hole at the end */
+				cut = -min((int)(generator() % (4 * 1024 * 1024)), MAX_FILE_SIZE - size);
+			}
+			if (!fs.fs_truncate(file.inumber, size - cut))
+			{
+				printf("FAIL: operation %d, truncate\n", op);
+				return false;
+			}
+			file.content.resize(size - cut);
+		}
+		else if (choice < 15)
+		{
+			if (!fs.fs_delete(file.inumber))
+			{
+				printf("FAIL: operation %d, delete\n", op);
+				return false;
+			}
+			file.inumber = fs.fs_create();
+			file.content.clear();
+			if (file.inumber <= 0)
+			{
+				printf("FAIL: operation %d, create\n", op);
+				return false;
+			}
+		}
+		else
+		{
+			long long offset = generator() % (size + 1);
+			int length = generator() % (buffer.size() + 1);
+			int read = fs.fs_read(file.inumber, buffer.data(), length, offset);
+			int expected = min((long long)length, size - offset);
+			if (read != expected || memcmp(buffer.data(), file.content.data() + offset, read))
+			{
+				printf("FAIL: operation %d read %d bytes at %lld, expected %d\n", op, read, offset, expected);
+				return false;
+			}
+		}
+
+		if (fs.fs_getsize(file.inumber) != (long long)file.content.size())
+		{
+			printf("FAIL: operation %d, size\n", op);
+			return false;
+		}
+		if (op % 1000 == 999 && fs.fs_fsck() != 0)
+		{
+			printf("FAIL: fsck after operation %d\n", op);
+			return false;
+		}
+	}
+
+	fs.fs_unmount();
+	disk.close();
+
+	/* Again from the image file alone, which tells the block size */
+	Disk diskAgain(options.image, options.nblocks, 0);
+	INE5412_FS fsAgain(&diskAgain);
+	if (!fsAgain.fs_mount())
+	{
+		printf("FAIL: could not mount %s again\n", options.image);
+		return false;
+	}
+	for (int i = 0; i < FILES; i++)
+	{
+		if (!same_content(fsAgain, files[i]))
+		{
+			printf("FAIL: content of inode %d after mounting again\n", files[i].inumber);
+			return false;
+		}
+	}
+	if (fsAgain.fs_fsck() != 0)
+	{
+		printf("FAIL: fsck after mounting again\n");
+		return false;
+	}
+	fsAgain.fs_unmount();
+	diskAgain.close();
+	unlink(options.image);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	model_options options;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-seed") && i + 1 < argc)
+		{
+			options.seed = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-ops") && i + 1 < argc)
+		{
+			options.operations = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "extents"))
+		{
+			options.format.extents = true;
+		}
+		else if (!strcmp(argv[i], "inline"))
+		{
+			options.format.inlineData = true;
+		}
+		else if (!strcmp(argv[i], "holes"))
+		{
+			options.holes = true;
+		}
+		else if (!strcmp(argv[i], "fragment"))
+		{
+			/* Large enough for more extents than 3 levels of half full 1 KB extent blocks hold */
+			options.fragment = true;
+			options.nblocks = 75000;
+		}
+		else if (!strncmp(argv[i], "block-size=", 11))
+		{
+			options.format.blockSize = atoi(argv[i] + 11);
+		}
+		else
+		{
+			printf("use: %s [-seed <n>] [-ops <n>] [extents] [inline] [holes] [fragment] [block-size=<bytes>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (options.fragment)
+	{
+		return run_fragment(options) ? 0 : 1;
+	}
+	if (!run_model(options))
+	{
+		return 1;
+	}
+	printf("model: %d operations, %d-byte blocks%s%s%s: OK\n", options.operations, options.format.blockSize,
+		   options.format.extents ? ", extents" : "", options.format.inlineData ? ", inline data" : "",
+		   options.holes ? ", holes" : "");
+	return 0;
+}
@@ -0,0 +1,225 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+* Offsets past what 32 bits hold.
+* A sparse file gets pieces written at 2 GB, 4 GB, 5 GB and 1 TB, which must read back the same,
+* survive fs_fsck and mounting again, and be cut at 4 GB by fs_truncate. A 1 TB image must format
+* and mount with an inode count that fits in an int. Then the Disk itself
+* writes blocks past 4 GB into the image file with each backend, and refuses a block size that
+* would give an image more blocks than an int holds.
+*/
+
+using namespace std;
+
+static const char *IMAGE = "tests/offsets.img";
+static const int PIECE = 1000;
+static const long long OFFSETS[] = {0, 2147483000LL, 4294967290LL, 5000000000LL, (1LL << 40) + 12345};
+static const int NOFFSETS = sizeof(OFFSETS) / sizeof(OFFSETS[0]);
+
+static vector<char> piece(int index)
+{
+	vector<char> data(PIECE);
+	for (int i = 0; i < PIECE; i++)
+	{
+		data[i] = i * 7 + index;
+	}
+	return data;
+}
+
+/* The first 'count' pieces read back, and so does the hole before the one at 2 GB */
+static bool check_pieces(INE5412_FS &fs, int inumber, int count)
+{
+	vector<char> buffer(PIECE);
+	for (int i = 0; i < count; i++)
+	{
+		if (fs.fs_read(inumber, buffer.data(), PIECE, OFFSETS[i]) != PIECE || buffer != piece(i))
+		{
+			printf("FAIL: read at %lld\n", OFFSETS[i]);
+			return false;
+		}
+	}
+	if (fs.fs_read(inumber, buffer.data(), PIECE, OFFSETS[1] - PIECE) != PIECE || buffer != vector<char>(PIECE, 0))
+	{
+		printf("FAIL: the hole before %lld does not read as zeros\n", OFFSETS[1]);
+		return false;
+	}
+	return true;
+}
+
+static bool file_test(bool extents)
+{
+	unlink(IMAGE);
+	Disk disk(IMAGE, 20000, 256);
+	INE5412_FS fs(&disk);
+	INE5412_FS::fs_format_options format;
+	format.extents = extents;
+	if (!fs.fs_format(format) || !fs.fs_mount())
+	{
+		printf("FAIL: could not format %s\n", IMAGE);
+		return false;
+	}
+
+	int inumber = fs.fs_create();
+	for (int i = 0; i < NOFFSETS; i++)
+	{
+		if (fs.fs_write(inumber, piece(i).data(), PIECE, OFFSETS[i]) != PIECE)
+		{
+			printf("FAIL: write at %lld\n", OFFSETS[i]);
+			return false;
+		}
+	}
+	if (fs.fs_getsize(inumber) != OFFSETS[NOFFSETS - 1] + PIECE || !check_pieces(fs, inumber, NOFFSETS))
+	{
+		return false;
+	}
+
+	fs.fs_unmount();
+	if (fs.fs_fsck() != 0 || !fs.fs_mount() || !check_pieces(fs, inumber, NOFFSETS))
+	{
+		printf("FAIL: after mounting again\n");
+		return false;
+	}
+
+	/* Cut in the middle of the piece at 4 GB, which leaves 6 bytes of it */
+	long long size = 4294967296LL;
+	vector<char> buffer(PIECE);
+	if (!fs.fs_truncate(inumber, size) || fs.fs_getsize(inumber) != size || !check_pieces(fs, inumber, 2) ||
+		fs.fs_read(inumber, buffer.data(), PIECE, OFFSETS[2]) != (int)(size - OFFSETS[2]))
+	{
+		printf("FAIL: truncate to %lld\n", size);
+		return false;
+	}
+	if (fs.fs_write(inumber, buffer.data(), PIECE, -5) != 0 || fs.fs_read(inumber, buffer.data(), PIECE, -5) != 0 ||
+		fs.fs_truncate(inumber, -1))
+	{
+		printf("FAIL: negative offsets must be refused\n");
+		return false;
+	}
+
+	fs.fs_unmount();
+	if (fs.fs_fsck() != 0)
+	{
+		printf("FAIL: fsck after the truncate\n");
+		return false;
+	}
+	disk.close();
+	return true;
+}
+
+/* Blocks past 4 GB, written with a cache, memory-mapped or straight to the file, read back without cache */
+static bool disk_test(int cacheblocks, bool mapped)
+{
+	int nblocks = 3000000;
+	vector<char> data(Disk::DEFAULT_BLOCK_SIZE, 'x');
+	vector<char> buffer(Disk::DEFAULT_BLOCK_SIZE);
+
+	unlink(IMAGE);
+	{
+		Disk disk(IMAGE, nblocks, cacheblocks, mapped);
+		for (int i = 0; i < 4; i++)
+		{
+			data[0] = i;
+			disk.write(nblocks - 1 - i * 700000, data.data());
+		}
+		disk.close();
+	}
+
+	Disk disk(IMAGE, nblocks, 0);
+	for (int i = 0; i < 4; i++)
+	{
+		data[0] = i;
+		disk.read(nblocks - 1 - i * 700000, buffer.data());
+		if (buffer != data)
+		{
+			printf("FAIL: block %d, cache %d%s\n", nblocks - 1 - i * 700000, cacheblocks, mapped ? ", mapped" : "");
+			return false;
+		}
+	}
+	disk.close();
+	return true;
+}
+
+/*
+* A 1 TB image, lazily formatted since zeroing its inode table would write 100 GB. The default
+* 10% of it would hold more inodes than an int, so it gets as many as fit instead, and a ratio
+* asking for more than that is refused.
+*/
+static bool disk_size_test()
+{
+	unlink(IMAGE);
+	Disk disk(IMAGE, 268435456, 64);
+	INE5412_FS fs(&disk);
+	INE5412_FS::fs_format_options format;
+	format.bytesPerInode = 256;
+	if (fs.fs_format(format))
+	{
+		printf("FAIL: a ratio of 256 bytes per inode on 1 TB must be refused\n");
+		return false;
+	}
+
+	format.bytesPerInode = 0;
+	format.lazyInit = true;
+	if (!fs.fs_format(format) || !fs.fs_mount())
+	{
+		printf("FAIL: could not format a 1 TB image\n");
+		return false;
+	}
+	int inumber = fs.fs_create();
+	if (inumber <= 0 || fs.fs_write(inumber, piece(0).data(), PIECE, OFFSETS[3]) != PIECE)
+	{
+		printf("FAIL: write on a 1 TB image\n");
+		return false;
+	}
+
+	fs.fs_unmount();
+	vector<char> buffer(PIECE);
+	if (fs.fs_fsck() != 0 || !fs.fs_mount() || fs.fs_read(inumber, buffer.data(), PIECE, OFFSETS[3]) != PIECE ||
+		buffer != piece(0))
+	{
+		printf("FAIL: 1 TB image after mounting again\n");
+		return false;
+	}
+	fs.fs_unmount();
+	disk.close();
+	return true;
+}
+
+/* A 2 TB image has more blocks of 1 KB than a block number holds, but not of 2 KB */
+static bool block_count_test()
+{
+	unlink(IMAGE);
+	Disk disk(IMAGE, 536870912, 0);
+	if (disk.set_block_size(1024) || disk.size() != 536870912)
+	{
+		printf("FAIL: 1 KB blocks of a 2 TB image must be refused\n");
+		return false;
+	}
+	if (!disk.set_block_size(2048) || disk.size() != 1073741824)
+	{
+		printf("FAIL: 2 KB blocks of a 2 TB image\n");
+		return false;
+	}
+	disk.close();
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if (!file_test(false) || !file_test(true) ||
+		!disk_test(64, false) || !disk_test(64, true) || !disk_test(0, false) ||
+		!disk_size_test() || !block_count_test())
+	{
+		return 1;
+	}
+
+	unlink(IMAGE);
+	printf("offsets: OK\n");
+	return 0;
+}
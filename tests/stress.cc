@@ -0,0 +1,314 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/*
+* Multi-threaded stress test.
+* Every thread owns a few files it writes, truncates, reads back, deletes and creates again,
+* checking each result against a copy kept in memory, while all of them also read a set of
+* shared files. Afterwards the image must pass fs_fsck, and once mounted again it must still
+* hold what the copies say.
+*/
+
+using namespace std;
+
+static const int FILES_PER_THREAD = 3;
+static const int SHARED_FILES = 4;
+
+class stress_options
+{
+public:
+	const char *image = "tests/stress.img";
+	int nblocks = 20000;
+	int threads = 8;
+	int operations = 1500;
+	int cacheblocks = Disk::DEFAULT_CACHE_BLOCKS;
+	bool writeback = false;
+	bool uring = true;
+	INE5412_FS::fs_format_options format;
+};
+
+/* Files of one thread, with what they should hold */
+class stress_files
+{
+public:
+	vector<int> inumbers;
+	vector<vector<char>> contents;
+	/* Where the last read of each file stopped, so that reads often carry on from there and start readahead */
+	vector<int> nextRead;
+};
+
+static atomic<int> failures(0);
+
+static void fail(const char *what, int thread)
+{
+	printf("FAIL: %s (thread %d)\n", what, thread);
+	failures++;
+}
+
+static void run_thread(INE5412_FS &fs, int thread, int operations, stress_files &files,
+					   const vector<int> &shared, const vector<vector<char>> &sharedContents)
+{
+	mt19937 generator(thread * 7 + 1);
+	vector<char> buffer(200000);
+
+	for (int i = 0; i < FILES_PER_THREAD; i++)
+	{
+		files.inumbers.push_back(fs.fs_create());
+		files.contents.push_back(vector<char>());
+		files.nextRead.push_back(0);
+		if (files.inumbers[i] <= 0)
+		{
+			fail("create", thread);
+			return;
+		}
+	}
+
+	for (int op = 0; op < operations && failures == 0; op++)
+	{
+		int file = generator() % FILES_PER_THREAD;
+		int inumber = files.inumbers[file];
+		vector<char> &content = files.contents[file];
+		int size = content.size();
+		int choice = generator() % 12;
+
+		if (choice < 4)
+		{
+			/* Mostly small writes, now and then one spanning many blocks */
+			int offset = generator() % (size + 1);
+			int length = 1 + generator() % (generator() % 4 == 0 ? 60000 : 9000);
+			for (int i = 0; i < length; i++)
+			{
+				buffer[i] = generator();
+			}
+			int written = fs.fs_write(inumber, buffer.data(), length, offset);
+			if (written != length)
+			{
+				fail("write", thread);
+				return;
+			}
+			if (offset + written > size)
+			{
+				content.resize(offset + written);
+			}
+			memcpy(content.data() + offset, buffer.data(), written);
+		}
+		else if (choice < 5)
+		{
+			int length = generator() % (size + 1);
+			if (!fs.fs_truncate(inumber, length))
+			{
+				fail("truncate", thread);
+				return;
+			}
+			content.resize(length);
+		}
+		else if (choice < 6)
+		{
+			if (!fs.fs_delete(inumber))
+			{
+				fail("delete", thread);
+				return;
+			}
+			files.inumbers[file] = fs.fs_create();
+			content.clear();
+			if (files.inumbers[file] <= 0)
+			{
+				fail("create", thread);
+				return;
+			}
+		}
+		else if (choice < 9)
+		{
+			int offset = generator() % 2 ? min(files.nextRead[file], size) : generator() % (size + 1);
+			int length = generator() % 70000;
+			int read = fs.fs_read(inumber, buffer.data(), length, offset);
+			if (read != min(length, size - offset) || memcmp(buffer.data(), content.data() + offset, read))
+			{
+				fail("read of an own file", thread);
+				return;
+			}
+			files.nextRead[file] = offset + read;
+		}
+		else
+		{
+			/* Shared files, sometimes at block-aligned offsets */
+			int file = generator() % SHARED_FILES;
+			int sharedSize = sharedContents[file].size();
+			int offset = generator() % (sharedSize + 1);
+			if (generator() % 2)
+			{
+				offset -= offset % 16384;
+			}
+			int length = generator() % 40000;
+			int read = fs.fs_read(shared[file], buffer.data(), length, offset);
+			if (read != min(length, sharedSize - offset) ||
+				memcmp(buffer.data(), sharedContents[file].data() + offset, read))
+			{
+				fail("read of a shared file", thread);
+				return;
+			}
+		}
+
+		if (fs.fs_getsize(files.inumbers[file]) != (long long)files.contents[file].size())
+		{
+			fail("size", thread);
+			return;
+		}
+	}
+}
+
+static bool verify(INE5412_FS &fs, const vector<stress_files> &files)
+{
+	vector<char> buffer(5 * 1024 * 1024);
+	for (size_t thread = 0; thread < files.size(); thread++)
+	{
+		for (size_t file = 0; file < files[thread].inumbers.size(); file++)
+		{
+			const vector<char> &content = files[thread].contents[file];
+			int read = fs.fs_read(files[thread].inumbers[file], buffer.data(), buffer.size(), 0);
+			if (read != (int)content.size() || memcmp(buffer.data(), content.data(), read))
+			{
+				fail("contents after mounting again", thread);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	stress_options options;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+		{
+			options.threads = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-ops") && i + 1 < argc)
+		{
+			options.operations = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-cache") && i + 1 < argc)
+		{
+			options.cacheblocks = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-writeback"))
+		{
+			options.writeback = true;
+		}
+		else if (!strcmp(argv[i], "-no-uring"))
+		{
+			options.uring = false;
+		}
+		else if (!strcmp(argv[i], "extents"))
+		{
+			options.format.extents = true;
+		}
+		else if (!strcmp(argv[i], "inline"))
+		{
+			options.format.inlineData = true;
+		}
+		else if (!strcmp(argv[i], "lazy"))
+		{
+			options.format.lazyInit = true;
+		}
+		else if (!strncmp(argv[i], "block-size=", 11))
+		{
+			options.format.blockSize = atoi(argv[i] + 11);
+		}
+		else
+		{
+			printf("use: %s [-threads <n>] [-ops <n>] [-cache <blocks>] [-writeback] [-no-uring] [extents] [inline] [lazy] [block-size=<bytes>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	vector<stress_files> files(options.threads);
+
+	unlink(options.image);
+	{
+		Disk disk(options.image, options.nblocks, options.cacheblocks, false, options.uring);
+		disk.set_writeback(options.writeback);
+		INE5412_FS fs(&disk);
+		if (!fs.fs_format(options.format) || !fs.fs_mount())
+		{
+			printf("FAIL: could not format %s\n", options.image);
+			return 1;
+		}
+
+		/* Written before the threads start, then only read */
+		vector<int> shared(SHARED_FILES);
+		vector<vector<char>> sharedContents(SHARED_FILES);
+		mt19937 generator(0);
+		for (int i = 0; i < SHARED_FILES; i++)
+		{
+			shared[i] = fs.fs_create();
+			sharedContents[i].resize(50000 + i * 70000);
+			for (size_t j = 0; j < sharedContents[i].size(); j++)
+			{
+				sharedContents[i][j] = generator();
+			}
+			fs.fs_write(shared[i], sharedContents[i].data(), sharedContents[i].size(), 0);
+		}
+
+		vector<thread> threads;
+		for (int i = 0; i < options.threads; i++)
+		{
+			threads.emplace_back(run_thread, ref(fs), i, options.operations, ref(files[i]), cref(shared), cref(sharedContents));
+		}
+		for (size_t i = 0; i < threads.size(); i++)
+		{
+			threads[i].join();
+		}
+		if (failures > 0)
+		{
+			return 1;
+		}
+
+		fs.fs_unmount();
+		if (fs.fs_fsck() != 0)
+		{
+			printf("FAIL: fsck found problems\n");
+			return 1;
+		}
+		disk.close();
+	}
+
+	/* Again from the image file alone */
+	{
+		Disk disk(options.image, options.nblocks, 0);
+		INE5412_FS fs(&disk);
+		if (!fs.fs_mount())
+		{
+			printf("FAIL: could not mount %s again\n", options.image);
+			return 1;
+		}
+		if (!verify(fs, files))
+		{
+			return 1;
+		}
+		if (fs.fs_fsck() != 0)
+		{
+			printf("FAIL: fsck found problems once mounted again\n");
+			return 1;
+		}
+		fs.fs_unmount();
+		disk.close();
+	}
+
+	unlink(options.image);
+	printf("stress: %d threads, %d operations each: OK\n", options.threads, options.operations);
+	return 0;
+}